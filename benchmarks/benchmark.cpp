@@ -8,7 +8,7 @@ constexpr uint32_t heights[] = { 768u, 1080u, 2160u, 4320u };
 constexpr int fromRange = 0;
 constexpr int toRange = 3;
 
-static void BM_Transform(benchmark::State& state, std::string_view objectName)
+static void BM_Transform(benchmark::State& state, std::string_view objectName, RenderMode mode, ShadingMode shading = ShadingMode::Forward)
 {
 	Camera camera;
 
@@ -25,22 +25,221 @@ static void BM_Transform(benchmark::State& state, std::string_view objectName)
 	Scene scene(camera);
 	scene.LoadObject(fmt::format("../assets/{0}.obj", objectName));
 
+	// The rasterizer is built once, every iteration renders a frame into the same buffers
+	Rasterizer rasterizer(std::move(scene), widths[state.range(0)], heights[state.range(0)]);
+	rasterizer.SetRenderMode(mode);
+	rasterizer.SetShadingMode(shading);
+
+	RenderStats stats;
 	for (auto _ : state)
 	{
-		Rasterizer rasterizer(std::move(scene), widths[state.range(0)], heights[state.range(0)]);
-		rasterizer.TransformScene();
+		rasterizer.BeginFrame(camera);
+		rasterizer.Render();
+		rasterizer.EndFrame();
+		stats = rasterizer.GetStats();
 	}
+
+	// Overdraw: shader invocations per covered pixel
+	state.counters["Shaded"] = static_cast<double>(stats.shadedFragments);
+	state.counters["Culled"] = static_cast<double>(stats.culledTriangles);
+	state.counters["Occluded"] = static_cast<double>(stats.occludedTriangles);
+	state.counters["Overdraw"] = stats.coveredPixels ? static_cast<double>(stats.shadedFragments) / stats.coveredPixels : 0.0;
 }
-BENCHMARK_CAPTURE(BM_Transform, TransformCube, "cube")
+BENCHMARK_CAPTURE(BM_Transform, TransformCube, "cube", RenderMode::Immediate)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond)
+->MinTime(10.0);
+BENCHMARK_CAPTURE(BM_Transform, TransformCubeTiled, "cube", RenderMode::Tiled)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond)
+->MinTime(10.0);
+BENCHMARK_CAPTURE(BM_Transform, TransformBackpack, "backpack", RenderMode::Immediate)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond)
+->MinTime(10.0);
+BENCHMARK_CAPTURE(BM_Transform, TransformBackpackTiled, "backpack", RenderMode::Tiled)
 ->DenseRange(fromRange, toRange, 1)
 ->Unit(benchmark::kMillisecond)
 ->MinTime(10.0);
-BENCHMARK_CAPTURE(BM_Transform, TransformBackpack, "backpack")
+BENCHMARK_CAPTURE(BM_Transform, TransformScene, "sponza", RenderMode::Immediate)
 ->DenseRange(fromRange, toRange, 1)
 ->Unit(benchmark::kMillisecond)
 ->MinTime(10.0);
-BENCHMARK_CAPTURE(BM_Transform, TransformScene, "sponza")
+BENCHMARK_CAPTURE(BM_Transform, TransformSceneTiled, "sponza", RenderMode::Tiled)
 ->DenseRange(fromRange, toRange, 1)
 ->Unit(benchmark::kMillisecond)
 ->MinTime(10.0);
+BENCHMARK_CAPTURE(BM_Transform, TransformSceneVisibility, "sponza", RenderMode::Immediate, ShadingMode::Visibility)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond)
+->MinTime(10.0);
+BENCHMARK_CAPTURE(BM_Transform, TransformSceneTiledVisibility, "sponza", RenderMode::Tiled, ShadingMode::Visibility)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond)
+->MinTime(10.0);
+static void BM_CameraPath(benchmark::State& state, std::string_view objectName, RenderMode mode)
+{
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(100.f);
+	camera.SetViewAngle(45.0f);
+	camera.SetEyePosition(glm::vec3(0, 5, 10));
+	camera.SetLookDirection(glm::vec3(0, 0, 0));
+	camera.SetupCamera();
+	Scene scene(camera);
+	scene.LoadObject(fmt::format("../assets/{0}.obj", objectName));
+
+	Rasterizer rasterizer(std::move(scene), widths[state.range(0)], heights[state.range(0)]);
+	rasterizer.SetRenderMode(mode);
+
+	// Orbit around the object, a new camera every frame
+	constexpr int framesPerTurn = 120;
+	int frame = 0;
+	for (auto _ : state)
+	{
+		const float angle = glm::radians(360.0f * static_cast<float>(frame++ % framesPerTurn) / framesPerTurn);
+		camera.SetEyePosition(glm::vec3(10.0f * std::sin(angle), 5.0f, 10.0f * std::cos(angle)));
+		camera.SetupCamera();
+
+		rasterizer.BeginFrame(camera);
+		rasterizer.Render();
+		rasterizer.EndFrame();
+	}
+	state.counters["FPS"] = benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_CameraPath, CameraPathBackpack, "backpack", RenderMode::Immediate)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_CameraPath, CameraPathBackpackTiled, "backpack", RenderMode::Tiled)
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+static void BM_WriteImage(benchmark::State& state, std::string_view objectName, ImageFormat format, std::string_view extension)
+{
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(100.f);
+	camera.SetEyePosition(glm::vec3(0, 5, 10));
+	camera.SetLookDirection(glm::vec3(0, 0, 0));
+	camera.SetViewAngle(45.0f);
+	camera.SetupCamera();
+	Scene scene(camera);
+	scene.LoadObject(fmt::format("../assets/{0}.obj", objectName));
+
+	Rasterizer rasterizer(std::move(scene), widths[state.range(0)], heights[state.range(0)]);
+	rasterizer.TransformScene();
+	const std::string file = fmt::format("render_{0}_{1}x{2}.{3}", objectName, widths[state.range(0)], heights[state.range(0)], extension);
+	const std::unique_ptr<ImageWriter> pWriter = CreateImageWriter(format);
+	for (auto _ : state)
+		rasterizer.RenderToFile(file, *pWriter);
+}
+
+BENCHMARK_CAPTURE(BM_WriteImage, WritePngBackpack, "backpack", ImageFormat::Png, "png")
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_WriteImage, WritePpmBackpack, "backpack", ImageFormat::Ppm, "ppm")
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_WriteImage, WritePfmBackpack, "backpack", ImageFormat::Pfm, "pfm")
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_WriteImage, WriteQoiBackpack, "backpack", ImageFormat::Qoi, "qoi")
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_WriteImage, WriteRawBackpack, "backpack", ImageFormat::Raw, "rgba")
+->DenseRange(fromRange, toRange, 1)
+->Unit(benchmark::kMillisecond);
+
+static void BM_LoadObject(benchmark::State& state, std::string_view objectName)
+{
+	Camera camera;
+	camera.SetupCamera();
+	const std::string path = fmt::format("../assets/{0}.obj", objectName);
+
+	size_t vertexCount = 0;
+	for (auto _ : state)
+	{
+		// Textures decode in the background, the load is only over once they are, as for the Rasterizer
+		Scene scene(camera);
+		scene.LoadObject(path);
+		scene.WaitForTextures();
+		vertexCount = scene.vertexBuffer.size();
+		benchmark::DoNotOptimize(scene.indexBuffer.data());
+	}
+
+	state.counters["Vertices"] = static_cast<double>(vertexCount);
+}
+
+BENCHMARK_CAPTURE(BM_LoadObject, LoadCube, "cube")
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_LoadObject, LoadBackpack, "backpack")
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_LoadObject, LoadScene, "sponza")
+->Unit(benchmark::kMillisecond);
+
+static void BM_LoadCache(benchmark::State& state, std::string_view objectName)
+{
+	Camera camera;
+	camera.SetupCamera();
+	const std::string cacheName = fmt::format("../assets/{0}.scene", objectName);
+	const std::string objectFile = fmt::format("../assets/{0}.obj", objectName);
+	{
+		Scene scene(camera);
+		scene.LoadObject(objectFile);
+		scene.WriteCache(cacheName, objectFile);
+	}
+
+	size_t vertexCount = 0;
+	for (auto _ : state)
+	{
+		Scene scene(camera);
+		if (!scene.LoadCache(cacheName, objectFile))
+		{
+			state.SkipWithError("scene cache rejected");
+			break;
+		}
+		vertexCount = scene.vertexBuffer.size();
+		benchmark::DoNotOptimize(scene.indexBuffer.data());
+	}
+
+	state.counters["Vertices"] = static_cast<double>(vertexCount);
+}
+
+BENCHMARK_CAPTURE(BM_LoadCache, LoadCacheCube, "cube")
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_LoadCache, LoadCacheBackpack, "backpack")
+->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_LoadCache, LoadCacheScene, "sponza")
+->Unit(benchmark::kMillisecond);
+
+// Cost of a loop of near empty tasks, what the renderer pays per parallel loop on top of the work itself
+static void BM_ParallelFor(benchmark::State& state)
+{
+	TaskScheduler scheduler;
+	const std::uint32_t taskCount = static_cast<std::uint32_t>(state.range(0));
+	std::vector<std::uint32_t> values(taskCount);
+	for (auto _ : state)
+	{
+		scheduler.ParallelFor(0u, taskCount, 1u, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			for (std::uint32_t i = begin; i < end; i++)
+				values[i]++;
+		});
+		benchmark::DoNotOptimize(values.data());
+	}
+	state.counters["Threads"] = static_cast<double>(scheduler.GetThreadCount());
+}
+BENCHMARK(BM_ParallelFor)
+->RangeMultiplier(8)
+->Range(8, 4096)
+->Unit(benchmark::kMicrosecond);
+
 BENCHMARK_MAIN();
\ No newline at end of file
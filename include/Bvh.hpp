@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+#include "Camera.hpp"
+
+// Run of spatially close triangles of a single mesh, the unit of culling
+struct Cluster
+{
+	// Index of the owning mesh in Scene::primitives
+	std::uint32_t mesh = 0u;
+
+	// Offset into the global index buffer, a multiple of 3 as meshes only hold whole triangles
+	std::uint32_t idxOffset = 0u;
+
+	// Number of triangles, at most Bvh::CLUSTER_SIZE
+	std::uint32_t triangleCount = 0u;
+
+	glm::vec3 boundsMin{ 0.0f };
+	glm::vec3 boundsMax{ 0.0f };
+};
+
+// Node of the hierarchy, covering a contiguous range of the sorted cluster list
+struct BvhNode
+{
+	glm::vec3 boundsMin{ 0.0f };
+	// Index of the left child, the right one follows it. 0 for leaves (the root is never a child)
+	std::uint32_t leftChild = 0u;
+	glm::vec3 boundsMax{ 0.0f };
+	std::uint32_t firstCluster = 0u;
+	std::uint32_t clusterCount = 0u;
+};
+
+// Bounding volume hierarchy over the triangle clusters of a scene
+class Bvh
+{
+public:
+
+	// Triangles per cluster
+	static constexpr std::uint32_t CLUSTER_SIZE = 128u;
+	// Clusters per leaf
+	static constexpr std::uint32_t LEAF_SIZE = 4u;
+	// Subtrees with more clusters than this are built as separate tasks
+	static constexpr std::uint32_t PARALLEL_BUILD_SIZE = 64u;
+
+	/// <summary>
+	/// Builds the hierarchy over the given clusters, splitting at the median centroid of the largest axis
+	/// </summary>
+	void Build(const std::vector<Cluster>& clusters);
+
+	/// <summary>
+	/// Walks the hierarchy and flags every cluster intersecting the frustum, subtrees fully inside are accepted without further tests
+	/// </summary>
+	/// <param name="visible">one entry per cluster, in the order given to Build</param>
+	void Cull(const Frustum& frustum, const std::vector<Cluster>& clusters, std::vector<std::uint8_t>& visible) const;
+
+	bool IsEmpty() const { return m_Nodes.empty(); }
+
+	const std::vector<BvhNode>& GetNodes() const { return m_Nodes; }
+
+private:
+
+	void BuildNode(const std::vector<Cluster>& clusters, std::uint32_t nodeIndex);
+
+	std::vector<BvhNode> m_Nodes{};
+	// Cluster indices sorted so that every node covers a contiguous range
+	std::vector<std::uint32_t> m_ClusterIndices{};
+	// Next free node, children being allocated by pairs from parallel builds
+	std::uint32_t m_NodeCount = 0u;
+};
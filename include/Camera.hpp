@@ -14,6 +14,31 @@ static constexpr std::uint32_t SCREEN_HEIGHT = 720u;
 static constexpr glm::vec3 UP(0, 1, 0);
 static constexpr glm::mat4 IDENTITY(1.f);
 
+// Result of testing a volume against the view frustum
+enum class FrustumTest
+{
+	Outside,
+	Intersecting,
+	Inside
+};
+
+// View frustum as six planes (left, right, bottom, top, near, far), xyz being the inward normal and w the distance
+struct Frustum
+{
+	glm::vec4 planes[6]{};
+
+	/// <summary>
+	/// Conservative test of an axis-aligned box against the frustum
+	/// </summary>
+	/// <returns>false only if the box is entirely outside of one of the planes</returns>
+	bool IntersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+	/// <summary>
+	/// Same test, also telling apart boxes entirely inside of the frustum
+	/// </summary>
+	FrustumTest ClassifyBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+};
+
 
 class Camera
 {
@@ -48,6 +73,11 @@ public:
 
 	void SetupCamera();
 
+	/// <summary>
+	/// Extracts the world-space frustum planes from the MVP matrix
+	/// </summary>
+	Frustum GetFrustum() const;
+
 	
 	glm::mat4 MVP{};
 
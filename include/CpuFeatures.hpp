@@ -0,0 +1,48 @@
+#pragma once
+
+// x86 targets get the AVX2 kernels, every other target only builds the scalar ones
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RASTERIZER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RASTERIZER_X86 0
+#endif
+
+// Functions using AVX2 intrinsics must be tagged so GCC/Clang generate them without compiling the whole project with -mavx2
+#if RASTERIZER_X86 && (defined(__GNUC__) || defined(__clang__))
+#define RASTERIZER_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define RASTERIZER_AVX2
+#endif
+
+/// <summary>
+/// Checks at runtime if the CPU (and the OS) support AVX2 and FMA
+/// </summary>
+inline bool CpuSupportsAVX2()
+{
+#if RASTERIZER_X86 && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif RASTERIZER_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// OSXSAVE, AVX and FMA support, then the OS must save the YMM registers on context switches
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	const bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave || !avx || !fma || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+
+// Storage format of the color buffer. Colors are quantized when they are shaded, the buffer never holds floats
+enum class FrameBufferFormat
+{
+	// 8 bits per channel, red in the low byte and opaque alpha, written to PNG files without conversion
+	RGBA8,
+	// 10 bits per color channel and 2 bits of alpha, less banding at the same size
+	RGB10A2,
+	// Half-float channels for HDR work, colors are not clamped. Takes two words per pixel
+	RGBA16F
+};
+
+/// <summary>
+/// Number of 32 bit words per pixel
+/// </summary>
+inline std::uint32_t GetPixelWords(FrameBufferFormat format)
+{
+	return format == FrameBufferFormat::RGBA16F ? 2u : 1u;
+}
+
+/// <summary>
+/// Rounds a float to the nearest half-float (ties to even), overflowing to infinity
+/// </summary>
+inline std::uint16_t FloatToHalf(float value)
+{
+	const std::uint32_t bits = std::bit_cast<std::uint32_t>(value);
+	const std::uint32_t sign = (bits >> 16) & 0x8000u;
+	const std::uint32_t magnitude = bits & 0x7FFFFFFFu;
+
+	// Infinity or NaN, then values rounding to infinity
+	if (magnitude >= 0x7F800000u)
+		return static_cast<std::uint16_t>(sign | (magnitude > 0x7F800000u ? 0x7E00u : 0x7C00u));
+	if (magnitude >= 0x477FF000u)
+		return static_cast<std::uint16_t>(sign | 0x7C00u);
+
+	// Normal half: rebias the exponent, round the 13 dropped mantissa bits
+	if (magnitude >= 0x38800000u)
+		return static_cast<std::uint16_t>(sign | ((magnitude - 0x38000000u + 0xFFFu + ((magnitude >> 13) & 1u)) >> 13));
+
+	// Subnormal half (or zero), the mantissa with its implicit bit is shifted down to a multiple of 2^-24
+	if (magnitude < 0x33000000u)
+		return static_cast<std::uint16_t>(sign);
+	const std::uint32_t shift = 126u - (magnitude >> 23);
+	const std::uint32_t mantissa = (magnitude & 0x7FFFFFu) | 0x800000u;
+	const std::uint32_t halfway = 1u << (shift - 1);
+	const std::uint32_t remainder = mantissa & ((halfway << 1) - 1);
+	std::uint32_t half = mantissa >> shift;
+	if (remainder > halfway || (remainder == halfway && (half & 1u)))
+		half++;
+	return static_cast<std::uint16_t>(sign | half);
+}
+
+inline float HalfToFloat(std::uint16_t half)
+{
+	const std::uint32_t sign = static_cast<std::uint32_t>(half & 0x8000u) << 16;
+	const std::uint32_t exponent = (half >> 10) & 0x1Fu;
+	const std::uint32_t mantissa = half & 0x3FFu;
+
+	if (exponent == 0)
+	{
+		const float value = std::ldexp(static_cast<float>(mantissa), -24);
+		return sign != 0 ? -value : value;
+	}
+	if (exponent == 0x1Fu)
+		return std::bit_cast<float>(sign | 0x7F800000u | (mantissa << 13));
+	return std::bit_cast<float>(sign | ((exponent + 112u) << 23) | (mantissa << 13));
+}
+
+/// <summary>
+/// Quantizes a color to the given format, the alpha being opaque. Fixed point channels are clamped then truncated
+/// </summary>
+/// <param name="pPixel">GetPixelWords(format) words</param>
+inline void PackColor(FrameBufferFormat format, const glm::vec3& color, std::uint32_t* pPixel)
+{
+	switch (format)
+	{
+	case FrameBufferFormat::RGBA8:
+	{
+		const std::uint32_t r = static_cast<std::uint32_t>(255 * std::clamp(color.r, 0.0f, 1.0f));
+		const std::uint32_t g = static_cast<std::uint32_t>(255 * std::clamp(color.g, 0.0f, 1.0f));
+		const std::uint32_t b = static_cast<std::uint32_t>(255 * std::clamp(color.b, 0.0f, 1.0f));
+		pPixel[0] = r | (g << 8) | (b << 16) | (0xFFu << 24);
+		break;
+	}
+	case FrameBufferFormat::RGB10A2:
+	{
+		const std::uint32_t r = static_cast<std::uint32_t>(1023 * std::clamp(color.r, 0.0f, 1.0f));
+		const std::uint32_t g = static_cast<std::uint32_t>(1023 * std::clamp(color.g, 0.0f, 1.0f));
+		const std::uint32_t b = static_cast<std::uint32_t>(1023 * std::clamp(color.b, 0.0f, 1.0f));
+		pPixel[0] = r | (g << 10) | (b << 20) | (0x3u << 30);
+		break;
+	}
+	case FrameBufferFormat::RGBA16F:
+		// Alpha 1.0 is 0x3C00
+		pPixel[0] = FloatToHalf(color.r) | (static_cast<std::uint32_t>(FloatToHalf(color.g)) << 16);
+		pPixel[1] = FloatToHalf(color.b) | (0x3C00u << 16);
+		break;
+	}
+}
+
+/// <summary>
+/// Converts a pixel of the given format back to a float color
+/// </summary>
+inline glm::vec3 UnpackColor(FrameBufferFormat format, const std::uint32_t* pPixel)
+{
+	switch (format)
+	{
+	case FrameBufferFormat::RGBA8:
+		return glm::vec3(pPixel[0] & 0xFFu, (pPixel[0] >> 8) & 0xFFu, (pPixel[0] >> 16) & 0xFFu) / 255.0f;
+	case FrameBufferFormat::RGB10A2:
+		return glm::vec3(pPixel[0] & 0x3FFu, (pPixel[0] >> 10) & 0x3FFu, (pPixel[0] >> 20) & 0x3FFu) / 1023.0f;
+	case FrameBufferFormat::RGBA16F:
+		return glm::vec3(HalfToFloat(static_cast<std::uint16_t>(pPixel[0])), HalfToFloat(static_cast<std::uint16_t>(pPixel[0] >> 16)),
+			HalfToFloat(static_cast<std::uint16_t>(pPixel[1])));
+	}
+	return glm::vec3(0.0f);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include "FrameBuffer.hpp"
+
+class TaskScheduler;
+
+// Frame handed to the image writers, pixels being read in place from the frame buffer
+struct FrameView
+{
+	std::uint32_t width = 0u;
+	std::uint32_t height = 0u;
+	FrameBufferFormat format = FrameBufferFormat::RGBA8;
+	// Rows from top to bottom, GetPixelWords(format) words per pixel
+	const std::uint32_t* pPixels = nullptr;
+	// Workers encoding the frame, TaskScheduler::GetDefault() if none
+	TaskScheduler* pScheduler = nullptr;
+};
+
+// File formats with a built-in writer
+enum class ImageFormat
+{
+	// Compressed on all cores, see PngEncoder
+	Png,
+	// Binary PPM (P6), 8 bit RGB
+	Ppm,
+	// Portable float map (PF), 32 bit float RGB, rows stored bottom to top as the format requires
+	Pfm,
+	// Quite OK Image format, 8 bit RGBA, a single fast sequential pass
+	Qoi,
+	// Pixels exactly as stored by the frame buffer (RGBA8: R, G, B, A bytes), without any header
+	Raw
+};
+
+// Encodes frames to files, one implementation per file format. Writers are stateless and can be shared by jobs
+class ImageWriter
+{
+public:
+
+	virtual ~ImageWriter() = default;
+
+	/// <summary>
+	/// Writes the frame to the given file, replacing it
+	/// </summary>
+	/// <returns>false if the file could not be written</returns>
+	virtual bool Write(const FrameView& frame, std::string_view fileName) const = 0;
+};
+
+class PngWriter : public ImageWriter
+{
+public:
+	// Chunks are written straight from the encoder buffers with a single gathered write
+	bool Write(const FrameView& frame, std::string_view fileName) const override;
+};
+
+class PpmWriter : public ImageWriter
+{
+public:
+	// Rows are converted in parallel straight into the mapped file
+	bool Write(const FrameView& frame, std::string_view fileName) const override;
+};
+
+class PfmWriter : public ImageWriter
+{
+public:
+	// Rows are converted in parallel straight into the mapped file
+	bool Write(const FrameView& frame, std::string_view fileName) const override;
+};
+
+class QoiWriter : public ImageWriter
+{
+public:
+	// Encoded into a mapping of the worst case size, then cut to the actual one
+	bool Write(const FrameView& frame, std::string_view fileName) const override;
+};
+
+class RawWriter : public ImageWriter
+{
+public:
+	// The frame buffer is written as is, no copy at all
+	bool Write(const FrameView& frame, std::string_view fileName) const override;
+};
+
+/// <summary>
+/// Returns the built-in writer of the given format
+/// </summary>
+std::unique_ptr<ImageWriter> CreateImageWriter(ImageFormat format);
@@ -0,0 +1,67 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <string_view>
+
+// Memory mapping of a whole file, read-only for existing files or writable for created ones, unmapped on destruction
+class MappedFile
+{
+public:
+
+	MappedFile() = default;
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile(MappedFile&& other) noexcept;
+	~MappedFile();
+
+	MappedFile& operator=(const MappedFile& other) = delete;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	/// <summary>
+	/// Maps the given file, closing any previous mapping. Returns false if the file is missing, empty or cannot be mapped
+	/// </summary>
+	bool Open(std::string_view fileName);
+
+	/// <summary>
+	/// Creates (or overwrites) a file of the given size and maps it for writing, closing any previous mapping
+	/// </summary>
+	bool Create(std::string_view fileName, std::size_t size);
+
+	void Close();
+
+	/// <summary>
+	/// Unmaps a created file and cuts it to the given size, for outputs whose size was only bounded when creating them
+	/// </summary>
+	void Close(std::size_t fileSize);
+
+	bool IsOpen() const { return m_pData != nullptr; }
+
+	/// <summary>
+	/// Start of the mapping, aligned on a page
+	/// </summary>
+	const std::byte* GetData() const { return m_pData; }
+
+	/// <summary>
+	/// Start of the mapping of a created file
+	/// </summary>
+	std::byte* GetWritableData()
+	{
+		assert(m_IsWritable && "File mapped read-only!");
+		return const_cast<std::byte*>(m_pData);
+	}
+
+	std::size_t GetSize() const { return m_Size; }
+
+private:
+
+	const std::byte* m_pData = nullptr;
+	std::size_t m_Size = 0;
+	bool m_IsWritable = false;
+#if defined(_WIN32)
+	// File mapping object, the view alone does not keep it alive
+	void* m_Mapping = nullptr;
+	// Created files stay open so that they can be cut on Close
+	void* m_File = nullptr;
+#else
+	int m_File = -1;
+#endif
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "TaskScheduler.hpp"
+
+// Fills the 8 bit RGB samples of one row of the image
+using PngRowSource = std::function<void(std::uint32_t y, std::uint8_t* pRow)>;
+
+// Encodes 8 bit RGB images to PNG on all cores, pigz style: the image is split into bands of rows that are filtered
+// and deflated independently, each band ending on a sync flush so that the streams can be concatenated into a single
+// zlib stream. Every band is primed with the end of the previous one so the compression ratio barely suffers
+class PngEncoder
+{
+public:
+
+	// Uncompressed bytes per band, large enough for the per band overhead to be negligible
+	static constexpr std::uint32_t BAND_BYTES = 128u * 1024u;
+	// Deflate window, the size of the dictionary given to each band
+	static constexpr std::uint32_t WINDOW_BYTES = 32u * 1024u;
+
+	/// <summary>
+	/// Encodes a whole image, rows being requested from every thread in any order
+	/// </summary>
+	/// <param name="scheduler">workers deflating the bands</param>
+	/// <returns>the pieces of the PNG file, to be written one after the other without stitching them first:
+	/// the signature with the header chunk, one IDAT chunk per band, then the end chunk</returns>
+	static std::vector<std::vector<std::uint8_t>> EncodeChunks(std::uint32_t width, std::uint32_t height, const PngRowSource& source,
+		TaskScheduler& scheduler = TaskScheduler::GetDefault());
+
+	/// <summary>
+	/// Same as EncodeChunks, concatenated
+	/// </summary>
+	/// <returns>the content of the PNG file</returns>
+	static std::vector<std::uint8_t> Encode(std::uint32_t width, std::uint32_t height, const PngRowSource& source,
+		TaskScheduler& scheduler = TaskScheduler::GetDefault());
+
+private:
+
+	/// <summary>
+	/// Applies the filter of the row, chosen with the usual minimum sum of absolute differences heuristic
+	/// </summary>
+	/// <param name="pPrevious">unfiltered previous row, zeros for the first one</param>
+	/// <param name="pFiltered">filter type byte followed by the filtered samples</param>
+	static void FilterRow(const std::uint8_t* pRow, const std::uint8_t* pPrevious, std::uint32_t rowBytes, std::uint8_t* pFiltered);
+};
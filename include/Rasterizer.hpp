@@ -1,5 +1,152 @@
 #pragma once
 #include "Scene.hpp"
+#include "CpuFeatures.hpp"
+#include "FrameBuffer.hpp"
+#include "ImageWriter.hpp"
+#include "TaskScheduler.hpp"
+
+// How the rasterizer distributes the work of a frame over the cores
+enum class RenderMode
+{
+	// Triangles are rasterized one after the other, the bands of blocks of each one being spread over the workers
+	Immediate,
+	// Sort-middle: triangles are set up and binned into screen tiles first, then each worker rasterizes whole tiles
+	Tiled
+};
+
+// How fragments passing the depth test get shaded
+enum class ShadingMode
+{
+	// Every fragment passing the depth test is shaded right away, even if a nearer one overwrites it later
+	Forward,
+	// A first pass only keeps the depth and ID of the visible triangle per pixel, a second one shades every pixel exactly once
+	Visibility
+};
+
+// Counters of the last TransformScene, used to measure overdraw
+struct RenderStats
+{
+	// Fragments that passed the depth test
+	std::uint64_t depthPassedFragments = 0u;
+	// FragmentShader invocations
+	std::uint64_t shadedFragments = 0u;
+	// Pixels covered by the final image
+	std::uint64_t coveredPixels = 0u;
+	// Triangles skipped because their cluster was outside of the view frustum
+	std::uint64_t culledTriangles = 0u;
+	// Triangles skipped whole by the Hi-Z test, once per tile they overlap in tiled mode
+	std::uint64_t occludedTriangles = 0u;
+};
+
+// Vertex going through triangle setup and clipping: raster-space position (z and w being the clip-space ones) and attributes
+struct SetupVertex
+{
+	glm::vec4 pos;
+	glm::vec3 normal;
+	glm::vec2 texCoords;
+};
+
+// Result of testing a triangle against the view frustum and the guard band
+enum class TriangleClip
+{
+	// Entirely outside of one of the frustum planes
+	Rejected,
+	// In front of the near plane and inside of the guard band, no clipping needed
+	Inside,
+	// Crosses the near plane or leaves the guard band
+	Clipped
+};
+
+// Result of testing a block of pixels against the three edges of a triangle
+enum class BlockCoverage
+{
+	Outside,
+	Partial,
+	Inside
+};
+
+// Integer edge function, e(x, y) = stepX * x + stepY * y + origin at the center of pixel (x, y). Computed from vertices
+// snapped to sub-pixel fixed point, so every value is exact and the same whatever the order of evaluation.
+// Positive inside of the triangle, samples lying exactly on the edge only count for top and left edges
+struct EdgeFunction
+{
+	std::int64_t stepX = 0;
+	std::int64_t stepY = 0;
+	std::int64_t origin = 0;
+
+	std::int64_t Evaluate(std::int32_t x, std::int32_t y) const { return stepX * x + stepY * y + origin; }
+};
+
+// Attributes interpolated over a triangle. All but 1/w are divided by w, so that they are linear in screen space
+enum TriangleAttribute : std::uint32_t
+{
+	ATTRIBUTE_ONE_OVER_W,
+	ATTRIBUTE_Z,
+	ATTRIBUTE_NX,
+	ATTRIBUTE_NY,
+	ATTRIBUTE_NZ,
+	ATTRIBUTE_U,
+	ATTRIBUTE_V,
+	ATTRIBUTE_COUNT
+};
+
+// Screen-space gradients of the attributes of a triangle, one array per component so that pixel loops can step all
+// the attributes at once or load one of them per vector. Attribute a at the center of pixel (x, y) is
+// start[a] + dx[a] * x + dy[a] * y, pixel loops evaluate it once then only add dx and dy
+struct AttributeGradients
+{
+	// Padded to a full AVX2 vector
+	static constexpr std::uint32_t PADDED_COUNT = 8u;
+
+	alignas(32) float start[PADDED_COUNT]{};
+	alignas(32) float dx[PADDED_COUNT]{};
+	alignas(32) float dy[PADDED_COUNT]{};
+
+	float Evaluate(std::uint32_t attribute, std::int32_t x, std::int32_t y) const
+	{
+		return start[attribute] + dx[attribute] * static_cast<float>(x) + dy[attribute] * static_cast<float>(y);
+	}
+};
+
+// Triangle after setup, holding everything needed to rasterize it in any region of the screen
+struct TriangleSetup
+{
+	// Interpolation of 1/w, z/w, normal/w and UV/w
+	AttributeGradients gradients;
+
+	// Edge functions, Ei being the edge opposite to vertex i
+	EdgeFunction E0;
+	EdgeFunction E1;
+	EdgeFunction E2;
+
+	// Depth range of the triangle, z being a convex combination of the vertices ones
+	float minZ = 0.0f;
+	float maxZ = 0.0f;
+
+	// Bounding box clamped to the screen (max values are exclusive)
+	std::int32_t minX = 0;
+	std::int32_t maxX = 0;
+	std::int32_t minY = 0;
+	std::int32_t maxY = 0;
+
+	Texture* pTexture = nullptr;
+
+	// Index of the triangle in the frame, written to the visibility buffer
+	std::uint32_t id = 0u;
+};
+
+// Triangles of a mesh waiting for setup, vertices being stored per triangle so that the SIMD setup gathers them one
+// triangle per lane
+struct TriangleBatch
+{
+	static constexpr std::uint32_t SIZE = 8u;
+
+	SetupVertex vertices[SIZE][3];
+	// Index of each triangle in the frame
+	std::uint32_t ids[SIZE]{};
+	std::uint32_t count = 0u;
+	Texture* pTexture = nullptr;
+};
 
 class Rasterizer
 {
@@ -7,6 +154,33 @@ public:
 	
 	static constexpr std::uint32_t DEFAULT_WIDTH = 3840u;
 	static constexpr std::uint32_t DEFAULT_HEIGHT = 2160u;
+	static constexpr std::uint32_t TILE_SIZE = 64u;
+	static constexpr std::uint32_t BLOCK_SIZE = 8u;
+	static constexpr std::uint32_t SUB_BLOCK_SIZE = 4u;
+	// Hi-Z levels cover 8x8, 16x16, 32x32 and 64x64 pixels, the last one being a tile
+	static constexpr std::uint32_t HIZ_LEVELS = 4u;
+	static constexpr std::uint32_t INVALID_TRIANGLE = UINT32_MAX;
+	// Half extent of the guard band, in multiples of the screen half extent (NDC units)
+	static constexpr float GUARD_BAND = 8.0f;
+	// Vertices are snapped to 1/256 of a pixel for coverage. The guard band keeps snapped coordinates under 2^25,
+	// so edge function values stay far from the int64 limits
+	static constexpr std::int32_t SUBPIXEL_BITS = 8;
+	// Triangles whose bounding box fits in 4x4 pixels get their gradients from the edge functions rather than from
+	// the inverse of the vertex matrix, and are rasterized without the block walk
+	static constexpr std::int32_t SMALL_TRIANGLE_SIZE = 4;
+	// Largest distance between the vertices of a small triangle for the SIMD setup to handle it, in pixels. Keeps its
+	// edge values in 32 bits, farther apart vertices can still make a small box when cut by the screen border
+	static constexpr std::int32_t SMALL_VERTEX_SPAN = 8;
+	// A triangle clipped against the near plane and the four guard band planes has at most 8 vertices
+	static constexpr std::uint32_t MAX_CLIPPED_VERTICES = 8u;
+	// States of a triangle after the setup pass of the tiled renderer
+	static constexpr std::uint8_t SETUP_CULLED = 0u;
+	static constexpr std::uint8_t SETUP_VISIBLE = 1u;
+	static constexpr std::uint8_t SETUP_NEEDS_CLIPPING = 2u;
+	// Iterations per task of the flat loops of a frame, large enough to amortize taking a task from the scheduler
+	static constexpr std::uint32_t PIXEL_GRAIN = 16384u;
+	static constexpr std::uint32_t VERTEX_GRAIN = 4096u;
+	static constexpr std::uint32_t TRIANGLE_GRAIN = 1024u;
 	 
 	/// <summary>
 	/// Creates a rasterizer
@@ -21,33 +195,278 @@ public:
 	/// <param name="width">screen width</param>
 	Rasterizer(Scene&& scene, std::uint32_t width, std::uint32_t height);
 
+	/// <summary>
+	/// Renders a single frame with the camera of the scene: BeginFrame, Render and EndFrame in a row
+	/// </summary>
 	void TransformScene();
 
+	/// <summary>
+	/// Starts a frame seen from the given camera, clearing the buffers allocated at construction in parallel.
+	/// The scene, the buffers and the per frame work arrays are kept from one frame to the next
+	/// </summary>
+	void BeginFrame(const Camera& camera);
+
+	/// <summary>
+	/// Draws the scene into the frame with the current render and shading modes
+	/// </summary>
+	void Render();
+
+	/// <summary>
+	/// Completes the frame statistics, the frame buffer then holds the final image until the next BeginFrame
+	/// </summary>
+	void EndFrame();
+
 	void RenderToPng(std::string_view filename);
 
+	/// <summary>
+	/// Writes the frame with the given encoder, reading the pixels in place from the frame buffer
+	/// </summary>
+	/// <returns>false if the file could not be written</returns>
+	bool RenderToFile(std::string_view filename, const ImageWriter& writer);
+
+	/// <summary>
+	/// Selects the path used by TransformScene
+	/// </summary>
+	/// <param name="mode">Immediate (per triangle) or Tiled (binned) rendering</param>
+	void SetRenderMode(RenderMode mode) { m_RenderMode = mode; }
+	RenderMode GetRenderMode() { return m_RenderMode; }
+
+	/// <summary>
+	/// Selects forward shading or visibility buffer (deferred) shading
+	/// </summary>
+	void SetShadingMode(ShadingMode mode) { m_ShadingMode = mode; }
+	ShadingMode GetShadingMode() { return m_ShadingMode; }
+
+	/// <summary>
+	/// Selects the storage format of the color buffer, which gets reallocated and cleared
+	/// </summary>
+	void SetFrameBufferFormat(FrameBufferFormat format);
+	FrameBufferFormat GetFrameBufferFormat() { return m_FrameBufferFormat; }
+
+	/// <summary>
+	/// Fragment counters of the last TransformScene
+	/// </summary>
+	RenderStats GetStats() { return m_Stats; }
+
+	/// <summary>
+	/// Enables the SIMD pixel kernels and triangle setup (only taken into account if the CPU supports it)
+	/// </summary>
+	void SetSimd(bool enabled);
+	bool IsSimdEnabled() { return m_RasterizePartialBlock != &Rasterizer::RasterizeBlockScalar<true>; }
+
+	/// <summary>
+	/// Sets up a batch of triangles needing no clipping with the setup selected by SetSimd, as the render modes do
+	/// </summary>
+	/// <returns>the number of triangles left after culling, written to pSetups in batch order</returns>
+	std::uint32_t SetupTriangles(const TriangleBatch& batch, TriangleSetup* pSetups) { return (this->*m_SetupTriangleBatch)(batch, pSetups); }
+
 	std::uint32_t GetScreenWidth() { return m_ScreenWidth; }
 	std::uint32_t GetScreenHeight() { return m_ScreenHeight; }
-	std::vector<glm::vec3> GetFrameBuffer() { return m_FrameBuffer; }
+	/// <summary>
+	/// Colors of the frame converted back to floats
+	/// </summary>
+	std::vector<glm::vec3> GetFrameBuffer();
+	/// <summary>
+	/// Pixels as stored, GetPixelWords(format) words each
+	/// </summary>
+	const std::vector<std::uint32_t>& GetFrameBufferData() { return m_FrameBuffer; }
 	std::vector<float> GetDepthBuffer() { return m_DepthBuffer; }
+	/// <summary>
+	/// Workers running every parallel loop of the rasterizer, started with it
+	/// </summary>
+	TaskScheduler& GetScheduler() { return m_Scheduler; }
 
 private:
 	
 	Scene m_Scene{};
+	TaskScheduler m_Scheduler{};
 
 	std::uint32_t m_ScreenWidth{};
 	std::uint32_t m_ScreenHeight{};
 
-	std::vector<glm::vec3> m_FrameBuffer{};
+	RenderMode m_RenderMode = RenderMode::Immediate;
+	ShadingMode m_ShadingMode = ShadingMode::Forward;
+	RenderStats m_Stats{};
+	// Between BeginFrame and EndFrame
+	bool m_IsInFrame = false;
+
+	// Pixel kernels selected at runtime depending on the CPU features, for partially covered and fully covered blocks
+	using RasterizeFunction = std::uint32_t (Rasterizer::*)(const TriangleSetup&, std::int32_t, std::int32_t, std::int32_t, std::int32_t);
+	RasterizeFunction m_RasterizePartialBlock = &Rasterizer::RasterizeBlockScalar<true>;
+	RasterizeFunction m_RasterizeInsideBlock = &Rasterizer::RasterizeBlockScalar<false>;
+	// Partially covered 8x8 blocks are split into 4x4 ones before per pixel coverage
+	bool m_RefineBlocks = true;
+	// Triangle setup selected the same way, for the triangles needing no clipping
+	using SetupBatchFunction = std::uint32_t (Rasterizer::*)(const TriangleBatch&, TriangleSetup*);
+	SetupBatchFunction m_SetupTriangleBatch = &Rasterizer::SetupTriangleBatchScalar;
+
+	FrameBufferFormat m_FrameBufferFormat = FrameBufferFormat::RGBA8;
+	std::vector<std::uint32_t> m_FrameBuffer{};
 	std::vector<float> m_DepthBuffer{};
+	// ID of the visible triangle per pixel, only allocated in visibility shading mode
+	std::vector<std::uint32_t> m_VisibilityBuffer{};
+
+	// Hi-Z pyramid: farthest depth of each block of m_DepthBuffer, every level halving the resolution of the previous one.
+	// Values are only ever lowered to a still conservative bound, a cell can be farther than its pixels but never nearer.
+	std::vector<float> m_HiZ[HIZ_LEVELS]{};
+	std::uint32_t m_HiZWidth[HIZ_LEVELS]{};
+	std::uint32_t m_HiZHeight[HIZ_LEVELS]{};
+
+	// Raster-space position of every vertex of the scene for the current frame
+	std::vector<glm::vec4> m_TransformedVertices{};
+
+	// Result of the frustum test of every cluster of the scene for the current frame
+	std::vector<std::uint8_t> m_ClusterVisible{};
+
+	// Tiled mode: set up triangles of the frame and their per tile lists
+	std::uint32_t m_TileCountX{};
+	std::uint32_t m_TileCountY{};
+	std::vector<TriangleSetup> m_Triangles{};
+	// SETUP_CULLED, SETUP_VISIBLE or SETUP_NEEDS_CLIPPING per set up triangle
+	std::vector<std::uint8_t> m_TriangleVisible{};
+	std::vector<std::uint32_t> m_TileOffsets{};
+	std::vector<std::uint32_t> m_TileCursors{};
+	std::vector<std::uint32_t> m_TileTriangles{};
 
 	glm::vec4 Raster(glm::vec4 vec);
 
 	void InitBuffers();
 
+	/// <summary>
+	/// Resets the color, depth, Hi-Z and visibility buffers, all in a single parallel region
+	/// </summary>
+	void ClearBuffers();
+
+	/// <summary>
+	/// Quantizes a shaded color into the frame buffer
+	/// </summary>
+	void WriteColor(std::uint32_t index, const glm::vec3& color)
+	{
+		PackColor(m_FrameBufferFormat, color, m_FrameBuffer.data() + index * GetPixelWords(m_FrameBufferFormat));
+	}
+
     glm::vec4 VertexShader(const VertexInput& input, const glm::mat4& MVP);
 
-	glm::vec3 FragmentShader(const VertexInput& input, Texture* pTexture);
+	/// <summary>
+	/// Samples the given mip level of the texture (clamped to the available ones)
+	/// </summary>
+	glm::vec3 FragmentShader(const VertexInput& input, Texture* pTexture, int mipLevel);
+
+	/// <summary>
+	/// Runs the VertexShader once per unique vertex of the scene and stores the raster-space results
+	/// </summary>
+	void TransformVertices();
+
+	/// <summary>
+	/// Walks the scene BVH against the camera frustum, so triangles of culled clusters never reach triangle setup
+	/// </summary>
+	void CullClusters();
+
+	/// <summary>
+	/// Fetches the attributes and the transformed positions of a triangle of the scene
+	/// </summary>
+	void FetchTriangle(std::uint32_t triangle, SetupVertex (&vertices)[3]);
+
+	/// <summary>
+	/// Tests a triangle against the view frustum (trivial reject) and against the near plane and guard band (clipping)
+	/// </summary>
+	[[nodiscard]] TriangleClip ClassifyTriangle(const SetupVertex (&vertices)[3]);
+
+	/// <summary>
+	/// Clips a triangle against the near plane and the guard band planes it crosses
+	/// </summary>
+	/// <returns>the number of vertices of the resulting convex polygon (0 if nothing is left)</returns>
+	std::uint32_t ClipTriangle(const SetupVertex (&vertices)[3], SetupVertex (&polygon)[MAX_CLIPPED_VERTICES]);
+
+	/// <summary>
+	/// Sets up its edge functions, interpolation vectors and bounding box. Triangles covering no pixel center are
+	/// dropped before any interpolation setup, small ones take a lighter path (see SMALL_TRIANGLE_SIZE)
+	/// </summary>
+	/// <returns>false if the triangle is back-facing, degenerate (once snapped to the sub-pixel grid) or covers no pixel</returns>
+	bool SetupTriangle(const SetupVertex& v0, const SetupVertex& v1, const SetupVertex& v2, Texture* pTexture, TriangleSetup& setup);
+
+	/// <summary>
+	/// Edge function of the edge going from a to b, positive on its right in raster space (y going down), which is the
+	/// inside of front-facing triangles. Coordinates are in sub-pixel units
+	/// </summary>
+	static EdgeFunction MakeEdgeFunction(std::int64_t ax, std::int64_t ay, std::int64_t bx, std::int64_t by);
+
+	/// <summary>
+	/// Sets up the triangles of a batch, writing the ones that survive culling to pSetups in batch order
+	/// </summary>
+	/// <returns>the number of set up triangles</returns>
+	std::uint32_t SetupTriangleBatchScalar(const TriangleBatch& batch, TriangleSetup* pSetups);
+
+#if RASTERIZER_X86
+	/// <summary>
+	/// SetupTriangleBatchScalar with one triangle per lane: snapping, culling and the inverse of the vertex matrix
+	/// are done for the whole batch at once. Snapped vertices, hence coverage, are the same as with SetupTriangle
+	/// </summary>
+	std::uint32_t SetupTriangleBatchAVX2(const TriangleBatch& batch, TriangleSetup* pSetups);
+#endif
+
+	/// <summary>
+	/// Immediate mode: rasterizes a set up triangle over its bounding box, one parallel band of blocks per iteration
+	/// </summary>
+	/// <returns>the number of fragments that passed the depth test</returns>
+	std::uint32_t RasterizeTriangleImmediate(const TriangleSetup& setup);
+
+	/// <summary>
+	/// Perspective divide of the attributes interpolated at a sample, w being the interpolated clip-space w
+	/// </summary>
+	VertexInput InterpolateAttributes(const float (&values)[AttributeGradients::PADDED_COUNT], float w);
+
+	/// <summary>
+	/// Nearest mip level from the screen-space derivatives of the texture coordinates,
+	/// computed analytically from the interpolation planes: d(u)/dx = w * (d(u/w)/dx - u * d(1/w)/dx)
+	/// </summary>
+	[[nodiscard]] int ComputeMipLevel(const TriangleSetup& setup, const glm::vec2& texCoords, float w);
+
+	/// <summary>
+	/// Shades every pixel of a region of the visibility buffer (max values are exclusive)
+	/// </summary>
+	/// <returns>the number of shaded pixels</returns>
+	std::uint32_t ResolveVisibility(std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY);
+
+	/// <summary>
+	/// Checks the Hi-Z pyramid to know if a triangle is behind everything already drawn in its bounding box
+	/// </summary>
+	[[nodiscard]] bool IsOccluded(const TriangleSetup& setup);
+
+	/// <summary>
+	/// Lowers the Hi-Z value of an 8x8 block to the given depth and propagates it up the pyramid
+	/// </summary>
+	void UpdateHiZ(std::uint32_t blockX, std::uint32_t blockY, float depth);
+
+	/// <summary>
+	/// Tests the edges of a triangle at the corner samples of a pixel region (max values are exclusive)
+	/// </summary>
+	[[nodiscard]] BlockCoverage ClassifyBlock(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY);
+
+	/// <summary>
+	/// Rasterizes the part of a triangle lying in the given pixel region (max values are exclusive).
+	/// The region is walked in 8x8 then 4x4 blocks (8x8 only with the SIMD kernel), blocks outside of
+	/// the triangle are skipped and blocks inside of it are shaded without per pixel coverage test.
+	/// Regions of at most SMALL_TRIANGLE_SIZE pixels square go straight to the per pixel kernel.
+	/// </summary>
+	/// <returns>the number of fragments that passed the depth test</returns>
+	std::uint32_t RasterizeTriangle(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY);
+
+	template<bool TestCoverage>
+	std::uint32_t RasterizeBlockScalar(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY);
+
+#if RASTERIZER_X86
+	template<bool TestCoverage>
+	std::uint32_t RasterizeBlockAVX2(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY);
+#endif
+
+	void TransformSceneImmediate();
+
+	void TransformSceneTiled();
+
+	void BinTriangles();
 
-	[[nodiscard]] float EvaluateEdgeFunction(const glm::vec3& E, const glm::vec2& sample);
+	/// <returns>the number of fragments that passed the depth test</returns>
+	std::uint32_t RasterizeTile(std::uint32_t tile);
 
 };
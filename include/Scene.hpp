@@ -6,21 +6,78 @@
 #include <vector>
 #include <cassert>
 #include <cstdint>
+#include <limits>
 #include <chrono>
+#include <future>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <tiny_obj_loader.h>
 #include <png.h>
 #include <stb_image.h>
 
 #include "Camera.hpp"
+#include "Bvh.hpp"
+#include "MappedFile.hpp"
+
+// One level of a mip chain, stored as 4x4 texel tiles so that neighbouring texels in any direction share cache lines.
+// Only made of 32 bit fields so that the AVX2 sampler can gather them per lane
+struct MipLevel
+{
+	static constexpr std::int32_t TILE_SHIFT = 2;
+	static constexpr std::int32_t TILE_SIZE = 1 << TILE_SHIFT;
+
+	// First texel of the level in Texture::texels
+	std::uint32_t offset = 0u;
+	std::int32_t width = 0;
+	std::int32_t height = 0;
+	// Number of tiles in a row, the last one being padded
+	std::int32_t tilesX = 0;
+
+	/// <summary>
+	/// Index of a texel in the tiled layout: tiles are row-major, and so are the texels inside of a tile
+	/// </summary>
+	std::uint32_t TexelIndex(std::uint32_t x, std::uint32_t y) const
+	{
+		const std::uint32_t tile = (y >> TILE_SHIFT) * tilesX + (x >> TILE_SHIFT);
+		return offset + ((tile << (2 * TILE_SHIFT)) | ((y & (TILE_SIZE - 1)) << TILE_SHIFT) | (x & (TILE_SIZE - 1)));
+	}
+};
+
+// 4x4 RGBA8 texels, exactly one cache line
+struct alignas(64) TexelTile
+{
+	std::uint32_t texels[MipLevel::TILE_SIZE * MipLevel::TILE_SIZE];
+};
 
 // Used for texture mapping
 struct Texture
 {
+	// Source image as loaded, with numChannels bytes per texel. Owned by the Scene, which frees it with stbi_image_free
+	// once the mip chain is built
 	stbi_uc* data = nullptr;
 	std::int32_t width = -1;
 	std::int32_t height = -1;
 	std::int32_t numChannels = -1;
+
+	// Mip chain sampled by the rasterizer, level 0 being a converted copy of data
+	std::vector<MipLevel> mips{};
+	// Texels of every level as RGBA8 (red in the low byte), whatever the channel count of the source
+	std::vector<TexelTile> tiles{};
+	// Same texels read in place from a scene cache mapping, tiles being left empty. The Scene keeps the mapping alive
+	const TexelTile* pMappedTiles = nullptr;
+
+	/// <summary>
+	/// Converts data to tiled RGBA8 and builds the mip chain down to 1x1 with a 2x2 box filter
+	/// </summary>
+	void GenerateMipChain();
+
+	const std::uint32_t* GetTexels() const
+	{
+		if (pMappedTiles != nullptr)
+			return pMappedTiles->texels;
+		return tiles.empty() ? nullptr : tiles.front().texels;
+	}
 };
 
 // Vertex data to be fed into each VertexShader invocation as input
@@ -40,8 +97,27 @@ struct Mesh
 	// How many indices this mesh contains. Number of triangles therefore equals (m_IdxCount / 3)
 	std::uint32_t idxCount = 0u;
 
-	// Texture map from material
-	std::string diffuseTexName;
+	// Index into Scene::materials
+	std::uint32_t materialIdx = 0u;
+
+	// Object-space bounding box, computed by Scene::BuildBvh
+	glm::vec3 boundsMin{ std::numeric_limits<float>::max() };
+	glm::vec3 boundsMax{ std::numeric_limits<float>::lowest() };
+};
+
+// Surface description shared by meshes, textures being resolved once at load time
+struct Material
+{
+	std::string name;
+
+	// Sampled by the FragmentShader
+	Texture* pDiffuse = nullptr;
+
+	// Maps referenced by the .mtl file but not used by the shading yet, kept by name and only resolved once needed
+	std::string normalTexName;
+	std::string specularTexName;
+	Texture* pNormal = nullptr;
+	Texture* pSpecular = nullptr;
 };
 
 // POD of indices of vertex data provided by tinyobjloader, used to map unique vertex data to indexed primitive
@@ -55,6 +131,11 @@ struct IndexedPrimitive
 	{
 		return memcmp(this, &other, sizeof(IndexedPrimitive)) > 0;
 	}
+
+	bool operator==(const IndexedPrimitive& other) const
+	{
+		return posIdx == other.posIdx && normalIdx == other.normalIdx && uvIdx == other.uvIdx;
+	}
 };
 
 class Scene
@@ -64,8 +145,14 @@ public:
 	std::vector<VertexInput> vertexBuffer{};
 	std::vector<uint32_t> indexBuffer{};
 	std::vector<Mesh> primitives{};
+	std::vector<Material> materials{};
+	// Owns every texture of the scene, by file name
 	std::map<std::string, Texture*> textures{};
 
+	// Triangle clusters of every mesh, in mesh order, and the hierarchy built over them
+	std::vector<Cluster> clusters{};
+	Bvh bvh{};
+
 	/// <summary>
 	/// Constructor
 	/// </summary>
@@ -80,9 +167,58 @@ public:
 
 	void LoadObject(std::string_view fileName);
 
+	/// <summary>
+	/// Appends the scene stored in a cache written by WriteCache. The file is mapped and the texture tiles are sampled
+	/// from the mapping without any copy, only the geometry is copied out.
+	/// Returns false, leaving the scene untouched, if the file is missing, was written by another version, from another
+	/// state of the source file, or holds records out of range of their sections
+	/// </summary>
+	bool LoadCache(std::string_view fileName, std::string_view sourceName = {});
+
+	/// <summary>
+	/// Writes the geometry, materials and mip chains of the scene to a binary cache to be loaded by LoadCache.
+	/// Records the size and write time of the source file the scene was loaded from, if any.
+	/// Waits for the textures still being decoded
+	/// </summary>
+	void WriteCache(std::string_view fileName, std::string_view sourceName = {});
+
+	/// <summary>
+	/// Returns the texture of the given file of the assets folder, registering it on first use.
+	/// New textures are decoded in the background, their texels are only valid after WaitForTextures
+	/// </summary>
+	Texture* LoadTexture(const std::string& name);
+
+	/// <summary>
+	/// Blocks until every texture registered by LoadTexture is decoded and has its mip chain. Called by the Rasterizer
+	/// </summary>
+	void WaitForTextures();
+
+	/// <summary>
+	/// Computes the mesh bounds, splits every mesh into clusters of consecutive triangles and builds the BVH over those.
+	/// Called by LoadObject, and must be called again whenever the geometry is changed by hand
+	/// </summary>
+	void BuildBvh();
+
 	Camera GetCamera() { return m_Camera; }
+	void SetCamera(const Camera& camera) { m_Camera = camera; }
 
 private:
 
 	Camera m_Camera{};
+
+	/// <summary>
+	/// Hands the queued textures to a set of workers, as many as half of the cores, which decode them one after the other
+	/// </summary>
+	void DecodeTextures();
+
+	// Scene caches the textures point into
+	std::vector<MappedFile> m_MappedFiles{};
+
+	// Textures registered by LoadTexture but not handed to workers yet, with their file name
+	std::vector<std::pair<std::string, Texture*>> m_TextureQueue{};
+	// Background workers decoding textures, joined by WaitForTextures
+	std::vector<std::future<void>> m_TextureWorkers{};
+	// Raised when the textures are released, so that the workers stop picking up new ones. Shared with them, as the
+	// Scene can be moved while they run
+	std::shared_ptr<std::atomic<bool>> m_DecodeCancelled = std::make_shared<std::atomic<bool>>(false);
 };
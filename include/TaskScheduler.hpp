@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads with one task deque per core and work stealing. A parallel loop is cut into
+// chunks spread over all the deques; every thread runs its own chunks in order and steals from the other end of
+// the busiest deques once it runs dry. Workers are started once and spin for a moment before going to sleep, so
+// back to back loops of a frame pay neither a thread wake-up nor a barrier each
+class TaskScheduler
+{
+public:
+
+	// Yields before an idle worker goes to sleep, covers the gap between two loops of a frame
+	static constexpr std::uint32_t SPIN_COUNT = 2048u;
+
+	/// <summary>
+	/// Starts threadCount - 1 workers, the thread calling ParallelFor being the last one
+	/// </summary>
+	/// <param name="threadCount">number of threads running the loops, 0 for one per hardware thread</param>
+	explicit TaskScheduler(std::uint32_t threadCount = 0u);
+	~TaskScheduler();
+
+	TaskScheduler(const TaskScheduler&) = delete;
+	TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+	std::uint32_t GetThreadCount() const { return static_cast<std::uint32_t>(m_Deques.size()); }
+
+	/// <summary>
+	/// Calls function(chunkBegin, chunkEnd) over [begin, end) cut into chunks of grain iterations, and returns once
+	/// all of them are done. The calling thread runs chunks too, loops can be nested. Without workers the whole range
+	/// is a single chunk, so the function must not assume a chunk size
+	/// </summary>
+	template<typename Function>
+	void ParallelFor(std::uint32_t begin, std::uint32_t end, std::uint32_t grain, const Function& function)
+	{
+		if (begin >= end)
+			return;
+
+		// A single chunk is not worth a round trip through the deques
+		if (end - begin <= grain || GetThreadCount() == 1u)
+		{
+			function(begin, end);
+			return;
+		}
+		Run(begin, end, grain, &CallRange<Function>, &function);
+	}
+
+	/// <summary>
+	/// Scheduler shared by code without one of its own, started on first use
+	/// </summary>
+	static TaskScheduler& GetDefault();
+
+private:
+
+	using RangeCallback = void (*)(const void* pContext, std::uint32_t begin, std::uint32_t end);
+
+	// A ParallelFor call, lives on the stack of the caller until its last chunk is done
+	struct Job
+	{
+		RangeCallback callback = nullptr;
+		const void* pContext = nullptr;
+		std::atomic<std::uint32_t> remaining{ 0u };
+	};
+
+	struct Task
+	{
+		Job* pJob = nullptr;
+		std::uint32_t begin = 0u;
+		std::uint32_t end = 0u;
+	};
+
+	// The owner pops from the back, thieves take from the front. Padded so that two deques never share a cache line
+	struct alignas(64) TaskDeque
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<TaskDeque> m_Deques;
+	std::vector<std::thread> m_Workers;
+
+	// Tasks pushed and not taken yet, what idle workers wait for
+	std::atomic<std::int64_t> m_Pending{ 0 };
+	std::atomic<bool> m_IsStopping{ false };
+	std::mutex m_SleepMutex;
+	std::condition_variable m_WakeUp;
+
+	template<typename Function>
+	static void CallRange(const void* pContext, std::uint32_t begin, std::uint32_t end)
+	{
+		(*static_cast<const Function*>(pContext))(begin, end);
+	}
+
+	void Run(std::uint32_t begin, std::uint32_t end, std::uint32_t grain, RangeCallback callback, const void* pContext);
+
+	void WorkerLoop(std::uint32_t index);
+
+	/// <summary>
+	/// Takes the next task of the given deque, or steals one from the others
+	/// </summary>
+	bool FindTask(std::uint32_t index, Task& task);
+
+	void Execute(const Task& task);
+
+	/// <summary>
+	/// Deque of the calling thread: its own for workers, the first one for any other thread
+	/// </summary>
+	std::uint32_t GetCurrentIndex() const;
+};
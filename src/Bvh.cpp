@@ -0,0 +1,139 @@
+#include "Bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iterator>
+#include <limits>
+#include <numeric>
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+void Bvh::Build(const std::vector<Cluster>& clusters)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("Bvh::Build");
+#endif
+	const std::uint32_t clusterCount = static_cast<std::uint32_t>(clusters.size());
+
+	m_Nodes.clear();
+	m_ClusterIndices.resize(clusterCount);
+	std::iota(m_ClusterIndices.begin(), m_ClusterIndices.end(), 0u);
+	if (clusterCount == 0)
+		return;
+
+	// A binary tree with at least one cluster per leaf never has more than 2n - 1 nodes
+	m_Nodes.resize(2 * clusterCount - 1);
+	m_Nodes[0].firstCluster = 0;
+	m_Nodes[0].clusterCount = clusterCount;
+	m_NodeCount = 1;
+
+	#pragma omp parallel
+	#pragma omp single
+	BuildNode(clusters, 0);
+
+	m_Nodes.resize(m_NodeCount);
+}
+
+void Bvh::BuildNode(const std::vector<Cluster>& clusters, std::uint32_t nodeIndex)
+{
+	BvhNode& node = m_Nodes[nodeIndex];
+	const auto first = m_ClusterIndices.begin() + node.firstCluster;
+	const auto last = first + node.clusterCount;
+
+	// Bounds of the node and of the cluster centroids it holds
+	glm::vec3 centroidMin(std::numeric_limits<float>::max());
+	glm::vec3 centroidMax(std::numeric_limits<float>::lowest());
+	node.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	node.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+	for (auto it = first; it != last; ++it)
+	{
+		const Cluster& cluster = clusters[*it];
+		node.boundsMin = glm::min(node.boundsMin, cluster.boundsMin);
+		node.boundsMax = glm::max(node.boundsMax, cluster.boundsMax);
+
+		const glm::vec3 centroid = (cluster.boundsMin + cluster.boundsMax) * 0.5f;
+		centroidMin = glm::min(centroidMin, centroid);
+		centroidMax = glm::max(centroidMax, centroid);
+	}
+
+	if (node.clusterCount <= LEAF_SIZE)
+		return;
+
+	// Median split along the largest axis of the centroids
+	const glm::vec3 extent = centroidMax - centroidMin;
+	const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	const auto middle = first + node.clusterCount / 2;
+	std::nth_element(first, middle, last, [&clusters, axis](std::uint32_t a, std::uint32_t b)
+		{
+			return clusters[a].boundsMin[axis] + clusters[a].boundsMax[axis] < clusters[b].boundsMin[axis] + clusters[b].boundsMax[axis];
+		});
+
+	const std::uint32_t left = std::atomic_ref<std::uint32_t>(m_NodeCount).fetch_add(2, std::memory_order_relaxed);
+	m_Nodes[left].firstCluster = node.firstCluster;
+	m_Nodes[left].clusterCount = node.clusterCount / 2;
+	m_Nodes[left + 1].firstCluster = node.firstCluster + node.clusterCount / 2;
+	m_Nodes[left + 1].clusterCount = node.clusterCount - node.clusterCount / 2;
+	node.leftChild = left;
+
+	// Both halves are disjoint ranges of the index list and of the node array, so they can be built concurrently
+	if (node.clusterCount > PARALLEL_BUILD_SIZE)
+	{
+		#pragma omp task
+		BuildNode(clusters, left);
+		BuildNode(clusters, left + 1);
+		#pragma omp taskwait
+	}
+	else
+	{
+		BuildNode(clusters, left);
+		BuildNode(clusters, left + 1);
+	}
+}
+
+void Bvh::Cull(const Frustum& frustum, const std::vector<Cluster>& clusters, std::vector<std::uint8_t>& visible) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("Bvh::Cull");
+#endif
+	visible.assign(clusters.size(), 0u);
+	if (m_Nodes.empty())
+		return;
+
+	// Median splits keep the depth logarithmic, 64 entries are plenty
+	std::uint32_t stack[64];
+	std::uint32_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		const BvhNode& node = m_Nodes[stack[--stackSize]];
+		const auto first = m_ClusterIndices.begin() + node.firstCluster;
+		const auto last = first + node.clusterCount;
+
+		switch (frustum.ClassifyBox(node.boundsMin, node.boundsMax))
+		{
+		case FrustumTest::Outside:
+			break;
+		case FrustumTest::Inside:
+			for (auto it = first; it != last; ++it)
+				visible[*it] = 1u;
+			break;
+		case FrustumTest::Intersecting:
+			if (node.leftChild != 0)
+			{
+				assert(stackSize + 2 <= std::size(stack) && "Hierarchy too deep for the traversal stack!");
+				stack[stackSize++] = node.leftChild;
+				stack[stackSize++] = node.leftChild + 1;
+			}
+			else
+			{
+				for (auto it = first; it != last; ++it)
+					visible[*it] = frustum.IntersectsBox(clusters[*it].boundsMin, clusters[*it].boundsMax);
+			}
+			break;
+		}
+	}
+}
@@ -67,4 +67,61 @@ void Camera::SetupCamera()
 		m_farPlane);
 
 	MVP = m_projection * m_view;
-}
\ No newline at end of file
+}
+Frustum Camera::GetFrustum() const
+{
+	// Gribb-Hartmann: the planes are sums and differences of the rows of the projection matrix (glm being column-major)
+	const glm::vec4 row0(MVP[0][0], MVP[1][0], MVP[2][0], MVP[3][0]);
+	const glm::vec4 row1(MVP[0][1], MVP[1][1], MVP[2][1], MVP[3][1]);
+	const glm::vec4 row2(MVP[0][2], MVP[1][2], MVP[2][2], MVP[3][2]);
+	const glm::vec4 row3(MVP[0][3], MVP[1][3], MVP[2][3], MVP[3][3]);
+
+	Frustum frustum;
+	frustum.planes[0] = row3 + row0;
+	frustum.planes[1] = row3 - row0;
+	frustum.planes[2] = row3 + row1;
+	frustum.planes[3] = row3 - row1;
+	// Depth goes from 0 to 1 (GLM_FORCE_DEPTH_ZERO_TO_ONE)
+	frustum.planes[4] = row2;
+	frustum.planes[5] = row3 - row2;
+	return frustum;
+}
+
+bool Frustum::IntersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+	for (const glm::vec4& plane : planes)
+	{
+		// Corner of the box the furthest along the plane normal, if it is outside the whole box is
+		const glm::vec3 corner(
+			plane.x >= 0.0f ? boxMax.x : boxMin.x,
+			plane.y >= 0.0f ? boxMax.y : boxMin.y,
+			plane.z >= 0.0f ? boxMax.z : boxMin.z);
+
+		if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+FrustumTest Frustum::ClassifyBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+	FrustumTest result = FrustumTest::Inside;
+	for (const glm::vec4& plane : planes)
+	{
+		// Nearest and furthest corners along the plane normal
+		const glm::vec3 farCorner(
+			plane.x >= 0.0f ? boxMax.x : boxMin.x,
+			plane.y >= 0.0f ? boxMax.y : boxMin.y,
+			plane.z >= 0.0f ? boxMax.z : boxMin.z);
+		const glm::vec3 nearCorner(
+			plane.x >= 0.0f ? boxMin.x : boxMax.x,
+			plane.y >= 0.0f ? boxMin.y : boxMax.y,
+			plane.z >= 0.0f ? boxMin.z : boxMax.z);
+
+		if (glm::dot(glm::vec3(plane), farCorner) + plane.w < 0.0f)
+			return FrustumTest::Outside;
+		if (glm::dot(glm::vec3(plane), nearCorner) + plane.w < 0.0f)
+			result = FrustumTest::Intersecting;
+	}
+	return result;
+}
@@ -0,0 +1,348 @@
+#include "ImageWriter.hpp"
+#include "MappedFile.hpp"
+#include "PngEncoder.hpp"
+#include "TaskScheduler.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+namespace
+{
+	// Piece of a file written by WriteBuffers
+	struct WriteBuffer
+	{
+		const void* pData;
+		std::size_t size;
+	};
+
+	// Writes the buffers one after the other, with a single gathered write as long as the system accepts them all
+	bool WriteBuffers(std::string_view fileName, const std::vector<WriteBuffer>& buffers)
+	{
+		const std::string path(fileName);
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		for (const WriteBuffer& buffer : buffers)
+		{
+			const char* pData = static_cast<const char*>(buffer.pData);
+			for (std::size_t written = 0; written < buffer.size;)
+			{
+				// WriteFile takes 32 bit sizes
+				DWORD count = 0;
+				const DWORD request = static_cast<DWORD>(std::min<std::size_t>(buffer.size - written, 1u << 30));
+				if (!WriteFile(file, pData + written, request, &count, nullptr))
+				{
+					CloseHandle(file);
+					return false;
+				}
+				written += count;
+			}
+		}
+		CloseHandle(file);
+#else
+		const int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (file == -1)
+			return false;
+
+		std::vector<iovec> vectors;
+		for (const WriteBuffer& buffer : buffers)
+			if (buffer.size > 0)
+				vectors.push_back({ const_cast<void*>(buffer.pData), buffer.size });
+
+		// At most 1024 buffers per call (the Linux limit), partial writes resuming in the middle of a buffer
+		constexpr std::size_t MAX_VECTORS = 1024u;
+		for (std::size_t first = 0; first < vectors.size();)
+		{
+			ssize_t written = writev(file, vectors.data() + first, static_cast<int>(std::min(vectors.size() - first, MAX_VECTORS)));
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				close(file);
+				return false;
+			}
+			for (; first < vectors.size() && static_cast<std::size_t>(written) >= vectors[first].iov_len; first++)
+				written -= vectors[first].iov_len;
+			if (first < vectors.size())
+			{
+				vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + written;
+				vectors[first].iov_len -= written;
+			}
+		}
+		close(file);
+#endif
+		return true;
+	}
+
+	// Opaque 8 bit RGBA color of a pixel, red in the low byte
+	std::uint32_t GetRGBA8(const FrameView& frame, std::size_t pixel)
+	{
+		if (frame.format == FrameBufferFormat::RGBA8)
+			return frame.pPixels[pixel];
+
+		std::uint32_t rgba;
+		PackColor(FrameBufferFormat::RGBA8, UnpackColor(frame.format, frame.pPixels + pixel * GetPixelWords(frame.format)), &rgba);
+		return rgba;
+	}
+
+	std::string GetSizeLine(const FrameView& frame)
+	{
+		return std::to_string(frame.width) + " " + std::to_string(frame.height) + "\n";
+	}
+
+	TaskScheduler& GetScheduler(const FrameView& frame)
+	{
+		return frame.pScheduler ? *frame.pScheduler : TaskScheduler::GetDefault();
+	}
+
+	// Rows converted per task by the uncompressed writers
+	constexpr std::uint32_t ROWS_PER_TASK = 16u;
+}
+
+bool PngWriter::Write(const FrameView& frame, std::string_view fileName) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("PngWriter::Write");
+#endif
+	const std::vector<std::vector<std::uint8_t>> chunks = PngEncoder::EncodeChunks(frame.width, frame.height, [&frame](std::uint32_t y, std::uint8_t* pRow)
+		{
+			for (std::uint32_t x = 0; x < frame.width; x++)
+			{
+				const std::uint32_t rgba = GetRGBA8(frame, static_cast<std::size_t>(y) * frame.width + x);
+				pRow[x * 3 + 0] = static_cast<std::uint8_t>(rgba);
+				pRow[x * 3 + 1] = static_cast<std::uint8_t>(rgba >> 8);
+				pRow[x * 3 + 2] = static_cast<std::uint8_t>(rgba >> 16);
+			}
+		}, GetScheduler(frame));
+
+	std::vector<WriteBuffer> buffers;
+	for (const std::vector<std::uint8_t>& chunk : chunks)
+		buffers.push_back({ chunk.data(), chunk.size() });
+	return WriteBuffers(fileName, buffers);
+}
+
+bool PpmWriter::Write(const FrameView& frame, std::string_view fileName) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("PpmWriter::Write");
+#endif
+	const std::string header = "P6\n" + GetSizeLine(frame) + "255\n";
+	const std::size_t rowBytes = static_cast<std::size_t>(frame.width) * 3;
+
+	MappedFile file;
+	if (!file.Create(fileName, header.size() + rowBytes * frame.height))
+		return false;
+	std::uint8_t* pData = reinterpret_cast<std::uint8_t*>(file.GetWritableData());
+	memcpy(pData, header.data(), header.size());
+	pData += header.size();
+
+	GetScheduler(frame).ParallelFor(0u, frame.height, ROWS_PER_TASK, [&](std::uint32_t firstRow, std::uint32_t lastRow)
+	{
+		for (std::uint32_t y = firstRow; y < lastRow; y++)
+		{
+			std::uint8_t* pRow = pData + y * rowBytes;
+			for (std::uint32_t x = 0; x < frame.width; x++)
+			{
+				const std::uint32_t rgba = GetRGBA8(frame, static_cast<std::size_t>(y) * frame.width + x);
+				pRow[x * 3 + 0] = static_cast<std::uint8_t>(rgba);
+				pRow[x * 3 + 1] = static_cast<std::uint8_t>(rgba >> 8);
+				pRow[x * 3 + 2] = static_cast<std::uint8_t>(rgba >> 16);
+			}
+		}
+	});
+	return true;
+}
+
+bool PfmWriter::Write(const FrameView& frame, std::string_view fileName) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("PfmWriter::Write");
+#endif
+	// A negative scale means little-endian floats
+	static_assert(std::endian::native == std::endian::little, "PFM files are written in the native byte order");
+	const std::string header = "PF\n" + GetSizeLine(frame) + "-1.0\n";
+	const std::size_t rowBytes = static_cast<std::size_t>(frame.width) * 3 * sizeof(float);
+
+	MappedFile file;
+	if (!file.Create(fileName, header.size() + rowBytes * frame.height))
+		return false;
+	std::uint8_t* pData = reinterpret_cast<std::uint8_t*>(file.GetWritableData());
+	memcpy(pData, header.data(), header.size());
+	pData += header.size();
+
+	const std::uint32_t words = GetPixelWords(frame.format);
+	GetScheduler(frame).ParallelFor(0u, frame.height, ROWS_PER_TASK, [&](std::uint32_t firstRow, std::uint32_t lastRow)
+	{
+		for (std::uint32_t y = firstRow; y < lastRow; y++)
+		{
+			// The header leaves the floats unaligned
+			std::uint8_t* pRow = pData + (frame.height - 1 - y) * rowBytes;
+			for (std::uint32_t x = 0; x < frame.width; x++)
+			{
+				const glm::vec3 color = UnpackColor(frame.format, frame.pPixels + (static_cast<std::size_t>(y) * frame.width + x) * words);
+				memcpy(pRow + x * 3 * sizeof(float), &color.r, sizeof(float));
+				memcpy(pRow + (x * 3 + 1) * sizeof(float), &color.g, sizeof(float));
+				memcpy(pRow + (x * 3 + 2) * sizeof(float), &color.b, sizeof(float));
+			}
+		}
+	});
+	return true;
+}
+
+bool QoiWriter::Write(const FrameView& frame, std::string_view fileName) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("QoiWriter::Write");
+#endif
+	constexpr std::size_t HEADER_SIZE = 14u;
+	constexpr std::uint8_t END_MARKER[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	const std::size_t pixelCount = static_cast<std::size_t>(frame.width) * frame.height;
+
+	// A pixel never takes more than 5 bytes (QOI_OP_RGBA)
+	MappedFile file;
+	if (!file.Create(fileName, HEADER_SIZE + pixelCount * 5 + sizeof(END_MARKER)))
+		return false;
+	std::uint8_t* const pData = reinterpret_cast<std::uint8_t*>(file.GetWritableData());
+	std::uint8_t* pOut = pData;
+
+	auto writeBigEndian = [&pOut](std::uint32_t value)
+		{
+			*pOut++ = static_cast<std::uint8_t>(value >> 24);
+			*pOut++ = static_cast<std::uint8_t>(value >> 16);
+			*pOut++ = static_cast<std::uint8_t>(value >> 8);
+			*pOut++ = static_cast<std::uint8_t>(value);
+		};
+
+	// Magic, size, 4 channels, sRGB with linear alpha
+	memcpy(pOut, "qoif", 4);
+	pOut += 4;
+	writeBigEndian(frame.width);
+	writeBigEndian(frame.height);
+	*pOut++ = 4u;
+	*pOut++ = 0u;
+
+	// Pixels are handled as packed RGBA8, the hash using each channel once
+	std::uint32_t index[64] = {};
+	std::uint32_t previous = 0xFF000000u;
+	std::uint32_t run = 0u;
+	for (std::size_t pixel = 0; pixel < pixelCount; pixel++)
+	{
+		const std::uint32_t rgba = GetRGBA8(frame, pixel);
+		if (rgba == previous)
+		{
+			// QOI_OP_RUN
+			if (++run == 62u || pixel == pixelCount - 1)
+			{
+				*pOut++ = static_cast<std::uint8_t>(0xC0u | (run - 1));
+				run = 0u;
+			}
+			continue;
+		}
+		if (run > 0u)
+		{
+			*pOut++ = static_cast<std::uint8_t>(0xC0u | (run - 1));
+			run = 0u;
+		}
+
+		const std::uint8_t r = static_cast<std::uint8_t>(rgba);
+		const std::uint8_t g = static_cast<std::uint8_t>(rgba >> 8);
+		const std::uint8_t b = static_cast<std::uint8_t>(rgba >> 16);
+		const std::uint8_t a = static_cast<std::uint8_t>(rgba >> 24);
+		const std::uint32_t hash = (r * 3u + g * 5u + b * 7u + a * 11u) % 64u;
+		if (index[hash] == rgba)
+		{
+			// QOI_OP_INDEX
+			*pOut++ = static_cast<std::uint8_t>(hash);
+		}
+		else if (a != static_cast<std::uint8_t>(previous >> 24))
+		{
+			// QOI_OP_RGBA
+			index[hash] = rgba;
+			*pOut++ = 0xFFu;
+			*pOut++ = r;
+			*pOut++ = g;
+			*pOut++ = b;
+			*pOut++ = a;
+		}
+		else
+		{
+			index[hash] = rgba;
+			const std::int8_t dr = static_cast<std::int8_t>(r - static_cast<std::uint8_t>(previous));
+			const std::int8_t dg = static_cast<std::int8_t>(g - static_cast<std::uint8_t>(previous >> 8));
+			const std::int8_t db = static_cast<std::int8_t>(b - static_cast<std::uint8_t>(previous >> 16));
+			const std::int8_t drg = static_cast<std::int8_t>(dr - dg);
+			const std::int8_t dbg = static_cast<std::int8_t>(db - dg);
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+			{
+				// QOI_OP_DIFF
+				*pOut++ = static_cast<std::uint8_t>(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+			}
+			else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+			{
+				// QOI_OP_LUMA
+				*pOut++ = static_cast<std::uint8_t>(0x80 | (dg + 32));
+				*pOut++ = static_cast<std::uint8_t>(((drg + 8) << 4) | (dbg + 8));
+			}
+			else
+			{
+				// QOI_OP_RGB
+				*pOut++ = 0xFEu;
+				*pOut++ = r;
+				*pOut++ = g;
+				*pOut++ = b;
+			}
+		}
+		previous = rgba;
+	}
+
+	memcpy(pOut, END_MARKER, sizeof(END_MARKER));
+	pOut += sizeof(END_MARKER);
+	file.Close(static_cast<std::size_t>(pOut - pData));
+	return true;
+}
+
+bool RawWriter::Write(const FrameView& frame, std::string_view fileName) const
+{
+#if TRACY_ENABLE
+	ZoneScopedN("RawWriter::Write");
+#endif
+	const std::size_t size = static_cast<std::size_t>(frame.width) * frame.height * GetPixelWords(frame.format) * sizeof(std::uint32_t);
+	return WriteBuffers(fileName, { { frame.pPixels, size } });
+}
+
+std::unique_ptr<ImageWriter> CreateImageWriter(ImageFormat format)
+{
+	switch (format)
+	{
+	case ImageFormat::Ppm:
+		return std::make_unique<PpmWriter>();
+	case ImageFormat::Pfm:
+		return std::make_unique<PfmWriter>();
+	case ImageFormat::Qoi:
+		return std::make_unique<QoiWriter>();
+	case ImageFormat::Raw:
+		return std::make_unique<RawWriter>();
+	default:
+		return std::make_unique<PngWriter>();
+	}
+}
@@ -17,7 +17,14 @@ int main()
 		camera.SetupCamera();
 	}
 	Scene scene(camera);
-	scene.LoadObject(fmt::format("../assets/{0}.obj", objectName));
+	// Parsing the OBJ and decoding its textures is only done once, later runs map the binary cache until the OBJ changes
+	const std::string cacheName = fmt::format("../assets/{0}.scene", objectName);
+	const std::string objectFile = fmt::format("../assets/{0}.obj", objectName);
+	if (!scene.LoadCache(cacheName, objectFile))
+	{
+		scene.LoadObject(objectFile);
+		scene.WriteCache(cacheName, objectFile);
+	}
 	Rasterizer rasterizer(std::move(scene));
 	rasterizer.TransformScene();
 	auto file = fmt::format("../../render_{0}_{1}x{2}.png", objectName, rasterizer.DEFAULT_WIDTH, rasterizer.DEFAULT_HEIGHT);
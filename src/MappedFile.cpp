@@ -0,0 +1,200 @@
+#include "MappedFile.hpp"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if (this != &other)
+	{
+		Close();
+		m_pData = std::exchange(other.m_pData, nullptr);
+		m_Size = std::exchange(other.m_Size, 0);
+		m_IsWritable = std::exchange(other.m_IsWritable, false);
+#if defined(_WIN32)
+		m_Mapping = std::exchange(other.m_Mapping, nullptr);
+		m_File = std::exchange(other.m_File, nullptr);
+#else
+		m_File = std::exchange(other.m_File, -1);
+#endif
+	}
+	return *this;
+}
+
+bool MappedFile::Open(std::string_view fileName)
+{
+	Close();
+	const std::string path(fileName);
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// The mapping object keeps the file open, so its handle can be closed right away
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return false;
+
+	void* pView = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (pView == nullptr)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+
+	m_Mapping = mapping;
+	m_pData = static_cast<const std::byte*>(pView);
+	m_Size = static_cast<std::size_t>(size.QuadPart);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file == -1)
+		return false;
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	// The mapping keeps its own reference to the file
+	void* pView = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (pView == MAP_FAILED)
+		return false;
+
+	m_pData = static_cast<const std::byte*>(pView);
+	m_Size = static_cast<std::size_t>(status.st_size);
+#endif
+	return true;
+}
+
+bool MappedFile::Create(std::string_view fileName, std::size_t size)
+{
+	Close();
+	const std::string path(fileName);
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	if (size == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	const std::uint64_t mappingSize = size;
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(mappingSize >> 32), static_cast<DWORD>(mappingSize), nullptr);
+	void* pView = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : nullptr;
+	if (pView == nullptr)
+	{
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	m_File = file;
+	m_Mapping = mapping;
+	m_pData = static_cast<const std::byte*>(pView);
+#else
+	const int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file == -1)
+		return false;
+
+	void* pView = size > 0 && ftruncate(file, static_cast<off_t>(size)) == 0
+		? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+	if (pView == MAP_FAILED)
+	{
+		close(file);
+		return false;
+	}
+
+	m_File = file;
+	m_pData = static_cast<const std::byte*>(pView);
+#endif
+	m_Size = size;
+	m_IsWritable = true;
+	return true;
+}
+
+void MappedFile::Close(std::size_t fileSize)
+{
+	if (m_pData == nullptr)
+		return;
+	assert(m_IsWritable && fileSize <= m_Size);
+
+#if defined(_WIN32)
+	// The file can only be cut once no view nor mapping object refers to it anymore
+	UnmapViewOfFile(m_pData);
+	CloseHandle(m_Mapping);
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(fileSize);
+	SetFilePointerEx(m_File, end, nullptr, FILE_BEGIN);
+	SetEndOfFile(m_File);
+	CloseHandle(m_File);
+	m_Mapping = nullptr;
+	m_File = nullptr;
+#else
+	munmap(const_cast<std::byte*>(m_pData), m_Size);
+	[[maybe_unused]] const int result = ftruncate(m_File, static_cast<off_t>(fileSize));
+	close(m_File);
+	m_File = -1;
+#endif
+	m_pData = nullptr;
+	m_Size = 0;
+	m_IsWritable = false;
+}
+
+void MappedFile::Close()
+{
+	if (m_pData == nullptr)
+		return;
+	if (m_IsWritable)
+	{
+		Close(m_Size);
+		return;
+	}
+
+#if defined(_WIN32)
+	UnmapViewOfFile(m_pData);
+	CloseHandle(m_Mapping);
+	m_Mapping = nullptr;
+#else
+	munmap(const_cast<std::byte*>(m_pData), m_Size);
+#endif
+	m_pData = nullptr;
+	m_Size = 0;
+}
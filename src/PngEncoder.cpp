@@ -0,0 +1,250 @@
+#include "PngEncoder.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <zlib.h>
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+namespace
+{
+	constexpr std::uint32_t BYTES_PER_PIXEL = 3u;
+	// Length and type of a chunk
+	constexpr std::size_t CHUNK_HEADER_SIZE = 8u;
+
+	// Compressed output of a band and what is needed to stitch the streams together
+	struct PngBand
+	{
+		std::vector<std::uint8_t> data;
+		uLong adler = 1u;
+		uLong size = 0u;
+	};
+
+	void AppendBigEndian(std::vector<std::uint8_t>& out, std::uint32_t value)
+	{
+		out.push_back(static_cast<std::uint8_t>(value >> 24));
+		out.push_back(static_cast<std::uint8_t>(value >> 16));
+		out.push_back(static_cast<std::uint8_t>(value >> 8));
+		out.push_back(static_cast<std::uint8_t>(value));
+	}
+
+	// Length, type, data, then the CRC of the type and the data
+	void AppendChunk(std::vector<std::uint8_t>& out, const char* type, const std::uint8_t* pData, std::size_t size)
+	{
+		AppendBigEndian(out, static_cast<std::uint32_t>(size));
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), pData, pData + size);
+
+		uLong crc = crc32(0u, reinterpret_cast<const Bytef*>(type), 4u);
+		if (size > 0)
+			crc = crc32(crc, pData, static_cast<uInt>(size));
+		AppendBigEndian(out, static_cast<std::uint32_t>(crc));
+	}
+
+	std::uint8_t PaethPredictor(std::uint8_t a, std::uint8_t b, std::uint8_t c)
+	{
+		const int p = a + b - c;
+		const int pa = std::abs(p - a);
+		const int pb = std::abs(p - b);
+		const int pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		return pb <= pc ? b : c;
+	}
+
+	// Residual of a sample for each PNG filter type: None, Sub, Up, Average and Paeth
+	template<int Type>
+	std::uint8_t FilterSample(std::uint8_t x, std::uint8_t a, std::uint8_t b, std::uint8_t c)
+	{
+		if constexpr (Type == 1)
+			return static_cast<std::uint8_t>(x - a);
+		else if constexpr (Type == 2)
+			return static_cast<std::uint8_t>(x - b);
+		else if constexpr (Type == 3)
+			return static_cast<std::uint8_t>(x - ((a + b) >> 1));
+		else if constexpr (Type == 4)
+			return static_cast<std::uint8_t>(x - PaethPredictor(a, b, c));
+		else
+			return x;
+	}
+
+	// Sum of the residuals as signed bytes
+	std::uint32_t ResidualCost(std::uint8_t residual)
+	{
+		return residual < 128u ? residual : 256u - residual;
+	}
+
+	template<int Type>
+	void FilterSamples(const std::uint8_t* pRow, const std::uint8_t* pPrevious, std::uint32_t rowBytes, std::uint8_t* pFiltered)
+	{
+		// The first pixel has no left neighbour
+		for (std::uint32_t i = 0; i < BYTES_PER_PIXEL; i++)
+			pFiltered[i] = FilterSample<Type>(pRow[i], 0u, pPrevious[i], 0u);
+		for (std::uint32_t i = BYTES_PER_PIXEL; i < rowBytes; i++)
+			pFiltered[i] = FilterSample<Type>(pRow[i], pRow[i - BYTES_PER_PIXEL], pPrevious[i], pPrevious[i - BYTES_PER_PIXEL]);
+	}
+}
+
+void PngEncoder::FilterRow(const std::uint8_t* pRow, const std::uint8_t* pPrevious, std::uint32_t rowBytes, std::uint8_t* pFiltered)
+{
+	// Residuals are summed as signed bytes for all five filters at once, the smallest sum usually compresses best
+	std::uint32_t sums[5] = {};
+	for (std::uint32_t i = 0; i < rowBytes; i++)
+	{
+		const std::uint8_t x = pRow[i];
+		const std::uint8_t a = i >= BYTES_PER_PIXEL ? pRow[i - BYTES_PER_PIXEL] : 0u;
+		const std::uint8_t b = pPrevious[i];
+		const std::uint8_t c = i >= BYTES_PER_PIXEL ? pPrevious[i - BYTES_PER_PIXEL] : 0u;
+		sums[0] += ResidualCost(FilterSample<0>(x, a, b, c));
+		sums[1] += ResidualCost(FilterSample<1>(x, a, b, c));
+		sums[2] += ResidualCost(FilterSample<2>(x, a, b, c));
+		sums[3] += ResidualCost(FilterSample<3>(x, a, b, c));
+		sums[4] += ResidualCost(FilterSample<4>(x, a, b, c));
+	}
+	const int bestType = static_cast<int>(std::min_element(sums, sums + 5) - sums);
+
+	pFiltered[0] = static_cast<std::uint8_t>(bestType);
+	switch (bestType)
+	{
+	case 0: FilterSamples<0>(pRow, pPrevious, rowBytes, pFiltered + 1); break;
+	case 1: FilterSamples<1>(pRow, pPrevious, rowBytes, pFiltered + 1); break;
+	case 2: FilterSamples<2>(pRow, pPrevious, rowBytes, pFiltered + 1); break;
+	case 3: FilterSamples<3>(pRow, pPrevious, rowBytes, pFiltered + 1); break;
+	default: FilterSamples<4>(pRow, pPrevious, rowBytes, pFiltered + 1); break;
+	}
+}
+
+std::vector<std::vector<std::uint8_t>> PngEncoder::EncodeChunks(std::uint32_t width, std::uint32_t height, const PngRowSource& source,
+	TaskScheduler& scheduler)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("PngEncoder::EncodeChunks");
+#endif
+	assert(width > 0 && height > 0 && "Empty image!");
+	const std::uint32_t rowBytes = width * BYTES_PER_PIXEL;
+	const std::uint32_t filteredBytes = rowBytes + 1;
+	const std::uint32_t bandRows = std::max(BAND_BYTES / filteredBytes, 1u);
+	const std::uint32_t bandCount = (height + bandRows - 1) / bandRows;
+	// Rows of the previous band that fill the window of the next one
+	const std::uint32_t dictionaryRows = (WINDOW_BYTES + filteredBytes - 1) / filteredBytes;
+
+	// Previous row of the first one
+	const std::vector<std::uint8_t> zeroRow(rowBytes, 0u);
+
+	std::vector<PngBand> bands(bandCount);
+	const auto deflateBand = [&](std::uint32_t band)
+	{
+#if TRACY_ENABLE
+		ZoneScopedN("Deflate Band");
+#endif
+		const std::uint32_t firstRow = band * bandRows;
+		const std::uint32_t lastRow = std::min(firstRow + bandRows, height);
+		const bool isLast = band == bandCount - 1;
+
+		// The dictionary rows are filtered again here rather than shared, and filtering them needs the raw row before them
+		const std::uint32_t primeRow = firstRow - std::min(firstRow, dictionaryRows);
+		const std::uint32_t sourceRow = primeRow > 0 ? primeRow - 1 : 0;
+		std::vector<std::uint8_t> raw((lastRow - sourceRow) * rowBytes);
+		for (std::uint32_t y = sourceRow; y < lastRow; y++)
+			source(y, raw.data() + (y - sourceRow) * rowBytes);
+
+		std::vector<std::uint8_t> filtered((lastRow - primeRow) * filteredBytes);
+		for (std::uint32_t y = primeRow; y < lastRow; y++)
+		{
+			const std::uint8_t* pRow = raw.data() + (y - sourceRow) * rowBytes;
+			FilterRow(pRow, y > 0 ? pRow - rowBytes : zeroRow.data(), rowBytes, filtered.data() + (y - primeRow) * filteredBytes);
+		}
+
+		const std::uint8_t* pInput = filtered.data() + (firstRow - primeRow) * filteredBytes;
+		const uInt inputSize = (lastRow - firstRow) * filteredBytes;
+		const uInt dictionarySize = std::min(WINDOW_BYTES, (firstRow - primeRow) * filteredBytes);
+
+		// Raw deflate, the zlib header and checksum are added once for the whole image
+		z_stream stream{};
+		int result = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED);
+		assert(result == Z_OK);
+		if (dictionarySize > 0)
+			deflateSetDictionary(&stream, pInput - dictionarySize, dictionarySize);
+
+		// Room is left for the IDAT chunk header, so that the band is written out as is
+		PngBand& output = bands[band];
+		output.data.assign(CHUNK_HEADER_SIZE, 0u);
+		if (band == 0)
+			output.data.insert(output.data.end(), { 0x78, 0x9C });
+		std::size_t outputSize = output.data.size();
+		output.data.resize(outputSize + deflateBound(&stream, inputSize) + 64);
+
+		// Every band but the last ends on a sync flush: byte aligned and without the final block flag
+		const int flush = isLast ? Z_FINISH : Z_SYNC_FLUSH;
+		stream.next_in = const_cast<Bytef*>(pInput);
+		stream.avail_in = inputSize;
+		for (;;)
+		{
+			stream.next_out = output.data.data() + outputSize;
+			stream.avail_out = static_cast<uInt>(output.data.size() - outputSize);
+			result = deflate(&stream, flush);
+			assert(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR);
+			outputSize = output.data.size() - stream.avail_out;
+			if (isLast ? result == Z_STREAM_END : stream.avail_out != 0)
+				break;
+			output.data.resize(output.data.size() * 2);
+		}
+		deflateEnd(&stream);
+		output.data.resize(outputSize);
+
+		output.adler = adler32(1u, pInput, inputSize);
+		output.size = inputSize;
+	};
+	scheduler.ParallelFor(0u, bandCount, 1u, [&](std::uint32_t firstBand, std::uint32_t lastBand)
+	{
+		for (std::uint32_t band = firstBand; band < lastBand; band++)
+			deflateBand(band);
+	});
+
+	// The zlib stream ends with the checksum of the whole filtered image
+	uLong adler = bands[0].adler;
+	for (std::uint32_t band = 1; band < bandCount; band++)
+		adler = adler32_combine(adler, bands[band].adler, static_cast<z_off_t>(bands[band].size));
+	AppendBigEndian(bands.back().data, static_cast<std::uint32_t>(adler));
+
+	std::vector<std::vector<std::uint8_t>> chunks;
+	std::vector<std::uint8_t> header = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+	// 8 bit RGB, no interlacing
+	std::vector<std::uint8_t> headerData;
+	AppendBigEndian(headerData, width);
+	AppendBigEndian(headerData, height);
+	headerData.insert(headerData.end(), { 8, 2, 0, 0, 0 });
+	AppendChunk(header, "IHDR", headerData.data(), headerData.size());
+	chunks.push_back(std::move(header));
+
+	// One IDAT chunk per band, decoders see a single continuous stream
+	for (PngBand& band : bands)
+	{
+		const std::uint32_t dataSize = static_cast<std::uint32_t>(band.data.size() - CHUNK_HEADER_SIZE);
+		std::vector<std::uint8_t> chunkHeader;
+		AppendBigEndian(chunkHeader, dataSize);
+		chunkHeader.insert(chunkHeader.end(), { 'I', 'D', 'A', 'T' });
+		std::copy(chunkHeader.begin(), chunkHeader.end(), band.data.begin());
+		AppendBigEndian(band.data, static_cast<std::uint32_t>(crc32(0u, band.data.data() + 4, dataSize + 4)));
+		chunks.push_back(std::move(band.data));
+	}
+
+	std::vector<std::uint8_t> end;
+	AppendChunk(end, "IEND", nullptr, 0);
+	chunks.push_back(std::move(end));
+	return chunks;
+}
+
+std::vector<std::uint8_t> PngEncoder::Encode(std::uint32_t width, std::uint32_t height, const PngRowSource& source,
+	TaskScheduler& scheduler)
+{
+	std::vector<std::vector<std::uint8_t>> chunks = EncodeChunks(width, height, source, scheduler);
+	std::vector<std::uint8_t> png;
+	for (const std::vector<std::uint8_t>& chunk : chunks)
+		png.insert(png.end(), chunk.begin(), chunk.end());
+	return png;
+}
@@ -1,5 +1,10 @@
 #include "Rasterizer.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+
 #if TRACY_ENABLE
 #include "tracy/Tracy.hpp"
 #endif // TRACY_ENABLE
@@ -9,7 +14,35 @@ Rasterizer::Rasterizer(Scene&& scene) : Rasterizer(std::move(scene), DEFAULT_WID
 Rasterizer::Rasterizer(Scene&& scene, std::uint32_t width, std::uint32_t height)
 	: m_Scene(std::move(scene)), m_ScreenWidth(width), m_ScreenHeight(height)
 {
+	// Textures still decoding in the background are joined here, at the latest
+	m_Scene.WaitForTextures();
+
+	// Scenes assembled by hand have no hierarchy nor sampling-ready textures yet
+	if (m_Scene.bvh.IsEmpty())
+		m_Scene.BuildBvh();
+	for (const auto& [name, pTexture] : m_Scene.textures)
+		if (pTexture->mips.empty())
+			pTexture->GenerateMipChain();
+
 	InitBuffers();
+	SetSimd(true);
+}
+
+void Rasterizer::SetSimd(bool enabled)
+{
+	m_RasterizePartialBlock = &Rasterizer::RasterizeBlockScalar<true>;
+	m_RasterizeInsideBlock = &Rasterizer::RasterizeBlockScalar<false>;
+	m_RefineBlocks = true;
+	m_SetupTriangleBatch = &Rasterizer::SetupTriangleBatchScalar;
+#if RASTERIZER_X86
+	if (enabled && CpuSupportsAVX2())
+	{
+		m_RasterizePartialBlock = &Rasterizer::RasterizeBlockAVX2<true>;
+		m_RasterizeInsideBlock = &Rasterizer::RasterizeBlockAVX2<false>;
+		m_RefineBlocks = false;
+		m_SetupTriangleBatch = &Rasterizer::SetupTriangleBatchAVX2;
+	}
+#endif
 }
 
 glm::vec4 Rasterizer::Raster(glm::vec4 vec)
@@ -20,10 +53,84 @@ glm::vec4 Rasterizer::Raster(glm::vec4 vec)
 void Rasterizer::InitBuffers()
 {
 	// Allocate and clear the frame buffer before starting to render to it
-	m_FrameBuffer = std::vector<glm::vec3>(m_ScreenWidth * m_ScreenHeight, glm::vec3(0, 0, 0)); // clear color black = vec3(0, 0, 0)
+	SetFrameBufferFormat(m_FrameBufferFormat);
 
 	// Allocate and clear the depth buffer to FLT_MAX as we utilize z values to resolve visibility now
 	m_DepthBuffer = std::vector<float>(m_ScreenWidth * m_ScreenHeight, FLT_MAX);
+
+	// Screen tiles used by the tiled mode, the last row/column may be partially covered
+	m_TileCountX = (m_ScreenWidth + TILE_SIZE - 1) / TILE_SIZE;
+	m_TileCountY = (m_ScreenHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+	// Hi-Z pyramid, its top level matches the tiles
+	static_assert(TILE_SIZE == BLOCK_SIZE << (HIZ_LEVELS - 1), "Top Hi-Z level must match the tile size");
+	for (std::uint32_t level = 0; level < HIZ_LEVELS; level++)
+	{
+		const std::uint32_t cellSize = BLOCK_SIZE << level;
+		m_HiZWidth[level] = (m_ScreenWidth + cellSize - 1) / cellSize;
+		m_HiZHeight[level] = (m_ScreenHeight + cellSize - 1) / cellSize;
+		m_HiZ[level] = std::vector<float>(m_HiZWidth[level] * m_HiZHeight[level], FLT_MAX);
+	}
+}
+
+void Rasterizer::SetFrameBufferFormat(FrameBufferFormat format)
+{
+	m_FrameBufferFormat = format;
+
+	const std::uint32_t words = GetPixelWords(format);
+	std::vector<std::uint32_t>(m_ScreenWidth * m_ScreenHeight * words).swap(m_FrameBuffer);
+
+	// Clear color black, opaque
+	std::uint32_t clearPixel[2];
+	PackColor(format, glm::vec3(0, 0, 0), clearPixel);
+	m_Scheduler.ParallelFor(0u, m_ScreenWidth * m_ScreenHeight, PIXEL_GRAIN, [&](std::uint32_t begin, std::uint32_t end)
+	{
+		for (std::uint32_t i = begin; i < end; i++)
+			for (std::uint32_t word = 0; word < words; word++)
+				m_FrameBuffer[i * words + word] = clearPixel[word];
+	});
+}
+
+void Rasterizer::ClearBuffers()
+{
+#if TRACY_ENABLE
+	ZoneScopedN("ClearBuffers");
+#endif
+	// Clear color black, opaque
+	const std::uint32_t words = GetPixelWords(m_FrameBufferFormat);
+	std::uint32_t clearPixel[2];
+	PackColor(m_FrameBufferFormat, glm::vec3(0, 0, 0), clearPixel);
+
+	// One row of tiles per task, which also covers whole cells of every Hi-Z level
+	const bool clearVisibility = m_ShadingMode == ShadingMode::Visibility;
+	m_Scheduler.ParallelFor(0u, m_ScreenHeight, TILE_SIZE, [&](std::uint32_t firstRow, std::uint32_t lastRow)
+	{
+		for (std::uint32_t i = firstRow * m_ScreenWidth; i < lastRow * m_ScreenWidth; i++)
+		{
+			for (std::uint32_t word = 0; word < words; word++)
+				m_FrameBuffer[i * words + word] = clearPixel[word];
+			m_DepthBuffer[i] = FLT_MAX;
+			if (clearVisibility)
+				m_VisibilityBuffer[i] = INVALID_TRIANGLE;
+		}
+
+		for (std::uint32_t level = 0; level < HIZ_LEVELS; level++)
+		{
+			const std::uint32_t cellSize = BLOCK_SIZE << level;
+			const std::uint32_t firstCell = firstRow / cellSize * m_HiZWidth[level];
+			const std::uint32_t lastCell = std::min((lastRow + cellSize - 1) / cellSize, m_HiZHeight[level]) * m_HiZWidth[level];
+			std::fill(m_HiZ[level].begin() + firstCell, m_HiZ[level].begin() + lastCell, FLT_MAX);
+		}
+	});
+}
+
+std::vector<glm::vec3> Rasterizer::GetFrameBuffer()
+{
+	std::vector<glm::vec3> colors(m_ScreenWidth * m_ScreenHeight);
+	const std::uint32_t words = GetPixelWords(m_FrameBufferFormat);
+	for (size_t i = 0; i < colors.size(); i++)
+		colors[i] = UnpackColor(m_FrameBufferFormat, m_FrameBuffer.data() + i * words);
+	return colors;
 }
 
 // Vertex Shader to apply perspective projections and also pass vertex attributes to Fragment Shader
@@ -34,250 +141,1066 @@ glm::vec4 Rasterizer::VertexShader(const VertexInput& input, const glm::mat4& MV
 }
 
 // Fragment Shader that will be run at every visible pixel on triangles to shade fragments
-glm::vec3 Rasterizer::FragmentShader(const VertexInput& input, Texture* pTexture)
+glm::vec3 Rasterizer::FragmentShader(const VertexInput& input, Texture* pTexture, int mipLevel)
 {
+	const MipLevel& mip = pTexture->mips[std::min(mipLevel, static_cast<int>(pTexture->mips.size()) - 1)];
+
 	// By using fractional part of texture coordinates only, we will REPEAT (or WRAP) the same texture multiple times
-	uint32_t idxS = static_cast<uint32_t>((input.texCoords.s - static_cast<int64_t>(input.texCoords.s)) * pTexture->width - 0.5f);
-	uint32_t idxT = static_cast<uint32_t>((input.texCoords.t - static_cast<int64_t>(input.texCoords.t)) * pTexture->height - 0.5f);
-	uint32_t idx = (idxT * pTexture->width + idxS) * pTexture->numChannels;
+	uint32_t idxS = static_cast<uint32_t>((input.texCoords.s - static_cast<int64_t>(input.texCoords.s)) * mip.width - 0.5f);
+	uint32_t idxT = static_cast<uint32_t>((input.texCoords.t - static_cast<int64_t>(input.texCoords.t)) * mip.height - 0.5f);
+	const std::uint32_t texel = pTexture->GetTexels()[mip.TexelIndex(idxS, idxT)];
 
-	float r = static_cast<float>(pTexture->data[idx++] * (1.f / 255));
-	float g = static_cast<float>(pTexture->data[idx++] * (1.f / 255));
-	float b = static_cast<float>(pTexture->data[idx++] * (1.f / 255));
+	float r = static_cast<float>(texel & 0xFFu) * (1.f / 255);
+	float g = static_cast<float>((texel >> 8) & 0xFFu) * (1.f / 255);
+	float b = static_cast<float>((texel >> 16) & 0xFFu) * (1.f / 255);
 
 	return glm::vec3(r, g, b);
 	////Used to see normals
 	//return (input.normal) * glm::vec3(0.5) + glm::vec3(0.5);
 }
 
-float Rasterizer::EvaluateEdgeFunction(const glm::vec3& E, const glm::vec2& sample)
+void Rasterizer::TransformVertices()
 {
-	// Interpolate edge function at given sample
-	return (E.x * sample.x) + (E.y * sample.y) + E.z;
-}
+#if TRACY_ENABLE
+	ZoneScopedN("Vertex Processing");
+#endif
+	const glm::mat4 MVP = m_Scene.GetCamera().MVP;
+	const std::uint32_t vertexCount = static_cast<std::uint32_t>(m_Scene.vertexBuffer.size());
 
-void Rasterizer::TransformScene()
-{
+	m_TransformedVertices.resize(vertexCount);
 
-	for (int i = 0; i < m_Scene.primitives.size(); i++)
+	// Every unique vertex is transformed once per frame, triangle setup then only fetches the results by index
+	m_Scheduler.ParallelFor(0u, vertexCount, VERTEX_GRAIN, [&](std::uint32_t begin, std::uint32_t end)
 	{
+		for (std::uint32_t i = begin; i < end; i++)
+		{
+			// Invoke VertexShader to transform the vertex from object-space to clip-space (-w, w), then apply viewport transformation
+			// Notice that we haven't applied homogeneous division and are still utilizing homogeneous coordinates
+			m_TransformedVertices[i] = Raster(VertexShader(m_Scene.vertexBuffer[i], MVP));
+		}
+	});
+}
+
+void Rasterizer::CullClusters()
+{
 #if TRACY_ENABLE
-		ZoneScopedN("Meshes");
+	ZoneScopedN("CullClusters");
 #endif
-		const int32_t triCount = m_Scene.primitives[i].idxCount / 3;
+	m_Scene.bvh.Cull(m_Scene.GetCamera().GetFrustum(), m_Scene.clusters, m_ClusterVisible);
+
+	for (size_t i = 0; i < m_Scene.clusters.size(); i++)
+		if (!m_ClusterVisible[i])
+			m_Stats.culledTriangles += m_Scene.clusters[i].triangleCount;
+}
+
+void Rasterizer::FetchTriangle(std::uint32_t triangle, SetupVertex (&vertices)[3])
+{
+	for (std::uint32_t corner = 0; corner < 3; corner++)
+	{
+		const std::uint32_t index = m_Scene.indexBuffer[triangle * 3 + corner];
+
+		// Raster-space position computed by TransformVertices, attributes straight from the vertex buffer
+		const VertexInput& input = m_Scene.vertexBuffer[index];
+		vertices[corner] = { m_TransformedVertices[index], input.normal, input.texCoords };
+	}
+}
+
+// Signed distances of a raster-space vertex to the clipping planes, positive inside.
+// Clip-space x and y are recovered from the raster-space ones: x = 2x'/width - w, y = w - 2y'/height
+namespace
+{
+	enum ClipPlane : std::uint32_t
+	{
+		CLIP_LEFT = 1u << 0,
+		CLIP_RIGHT = 1u << 1,
+		CLIP_TOP = 1u << 2,
+		CLIP_BOTTOM = 1u << 3,
+		CLIP_NEAR = 1u << 4,
+		CLIP_FAR = 1u << 5,
+		GUARD_LEFT = 1u << 6,
+		GUARD_RIGHT = 1u << 7,
+		GUARD_TOP = 1u << 8,
+		GUARD_BOTTOM = 1u << 9,
+	};
+
+	constexpr std::uint32_t FRUSTUM_PLANES = CLIP_LEFT | CLIP_RIGHT | CLIP_TOP | CLIP_BOTTOM | CLIP_NEAR | CLIP_FAR;
+	constexpr std::uint32_t CLIPPING_PLANES = CLIP_NEAR | GUARD_LEFT | GUARD_RIGHT | GUARD_TOP | GUARD_BOTTOM;
 
-		// Loop over triangles in a given scene.primitives[i] and rasterize them
-		for (int32_t idx = 0; idx < triCount; idx++)
+	float PlaneDistance(std::uint32_t plane, const glm::vec4& v, float width, float height, float guardBand)
+	{
+		switch (plane)
 		{
-#if TRACY_ENABLE
-			ZoneScopedN("Tri Calculations");
-#endif
+		case CLIP_LEFT: return v.x;
+		case CLIP_RIGHT: return width * v.w - v.x;
+		case CLIP_TOP: return v.y;
+		case CLIP_BOTTOM: return height * v.w - v.y;
+		case CLIP_NEAR: return v.z;
+		case CLIP_FAR: return v.w - v.z;
+		case GUARD_LEFT: return 2.0f * v.x / width + (guardBand - 1.0f) * v.w;
+		case GUARD_RIGHT: return (guardBand + 1.0f) * v.w - 2.0f * v.x / width;
+		case GUARD_TOP: return 2.0f * v.y / height + (guardBand - 1.0f) * v.w;
+		case GUARD_BOTTOM: return (guardBand + 1.0f) * v.w - 2.0f * v.y / height;
+		}
+		return 0.0f;
+	}
 
-			// Fetch vertex input of next triangle to be rasterized
-			const VertexInput& vi0 = m_Scene.vertexBuffer[m_Scene.indexBuffer[m_Scene.primitives[i].idxOffset + (idx * 3)]];
-			const VertexInput& vi1 = m_Scene.vertexBuffer[m_Scene.indexBuffer[m_Scene.primitives[i].idxOffset + (idx * 3 + 1)]];
-			const VertexInput& vi2 = m_Scene.vertexBuffer[m_Scene.indexBuffer[m_Scene.primitives[i].idxOffset + (idx * 3 + 2)]];
+	std::uint32_t OutCode(const glm::vec4& v, float width, float height, float guardBand)
+	{
+		std::uint32_t code = 0u;
+		for (std::uint32_t plane = CLIP_LEFT; plane <= GUARD_BOTTOM; plane <<= 1)
+			if (PlaneDistance(plane, v, width, height, guardBand) < 0.0f)
+				code |= plane;
+		return code;
+	}
+}
 
-			// Invoke VertexShader for each vertex of the triangle to transform them from object-space to clip-space (-w, w)
-			glm::mat MVP = m_Scene.GetCamera().MVP;
-			glm::vec4 v0Clip = VertexShader(vi0, MVP);
-			glm::vec4 v1Clip = VertexShader(vi1, MVP);
-			glm::vec4 v2Clip = VertexShader(vi2, MVP);
+TriangleClip Rasterizer::ClassifyTriangle(const SetupVertex (&vertices)[3])
+{
+	const float width = static_cast<float>(m_ScreenWidth);
+	const float height = static_cast<float>(m_ScreenHeight);
+	const std::uint32_t code0 = OutCode(vertices[0].pos, width, height, GUARD_BAND);
+	const std::uint32_t code1 = OutCode(vertices[1].pos, width, height, GUARD_BAND);
+	const std::uint32_t code2 = OutCode(vertices[2].pos, width, height, GUARD_BAND);
 
-			// Apply viewport transformation
-			// Notice that we haven't applied homogeneous division and are still utilizing homogeneous coordinates
-			glm::vec4 v0Homogen = Raster(v0Clip);
-			glm::vec4 v1Homogen = Raster(v1Clip);
-			glm::vec4 v2Homogen = Raster(v2Clip);
+	// All vertices outside of the same frustum plane, nothing to see (this also drops geometry behind the camera)
+	if ((code0 & code1 & code2 & FRUSTUM_PLANES) != 0u)
+		return TriangleClip::Rejected;
+
+	// Most triangles are in front of the near plane and inside of the guard band: they skip clipping entirely
+	if (((code0 | code1 | code2) & CLIPPING_PLANES) == 0u)
+		return TriangleClip::Inside;
+
+	return TriangleClip::Clipped;
+}
 
-			// Base vertex matrix
-			glm::mat3 M =
+std::uint32_t Rasterizer::ClipTriangle(const SetupVertex (&vertices)[3], SetupVertex (&polygon)[MAX_CLIPPED_VERTICES])
+{
+	const float width = static_cast<float>(m_ScreenWidth);
+	const float height = static_cast<float>(m_ScreenHeight);
+
+	SetupVertex buffer[MAX_CLIPPED_VERTICES];
+	std::copy(std::begin(vertices), std::end(vertices), polygon);
+	std::uint32_t count = 3;
+
+	// Sutherland-Hodgman in homogeneous space, only against the planes the triangle actually crosses
+	const std::uint32_t planes = (OutCode(vertices[0].pos, width, height, GUARD_BAND) |
+		OutCode(vertices[1].pos, width, height, GUARD_BAND) |
+		OutCode(vertices[2].pos, width, height, GUARD_BAND)) & CLIPPING_PLANES;
+
+	for (std::uint32_t plane = CLIP_NEAR; plane <= GUARD_BOTTOM && count > 0; plane <<= 1)
+	{
+		if ((planes & plane) == 0u)
+			continue;
+
+		std::copy(polygon, polygon + count, buffer);
+		std::uint32_t clippedCount = 0;
+		for (std::uint32_t i = 0; i < count; i++)
+		{
+			const SetupVertex& a = buffer[i];
+			const SetupVertex& b = buffer[(i + 1) % count];
+			const float da = PlaneDistance(plane, a.pos, width, height, GUARD_BAND);
+			const float db = PlaneDistance(plane, b.pos, width, height, GUARD_BAND);
+
+			if (da >= 0.0f)
+				polygon[clippedCount++] = a;
+
+			// Edge crosses the plane: add the intersection, attributes being linear in homogeneous space
+			if ((da >= 0.0f) != (db >= 0.0f))
 			{
-				// Notice that glm is itself column-major)
-				{ v0Homogen.x, v1Homogen.x, v2Homogen.x},
-				{ v0Homogen.y, v1Homogen.y, v2Homogen.y},
-				{ v0Homogen.w, v1Homogen.w, v2Homogen.w},
-			};
+				const float t = da / (da - db);
+				polygon[clippedCount++] = {
+					glm::mix(a.pos, b.pos, t),
+					glm::mix(a.normal, b.normal, t),
+					glm::mix(a.texCoords, b.texCoords, t) };
+			}
+		}
+		count = clippedCount;
+	}
+	return count >= 3 ? count : 0;
+}
 
-			// Singular vertex matrix (det(M) == 0.0) means that the triangle has zero area,
-			// which in turn means that it's a degenerate triangle which should not be rendered anyways,
-			// whereas (det(M) > 0) implies a back-facing triangle so we're going to skip such primitives
-			float det = glm::determinant(M);
-			if (det >= 0.0f)
-				continue;
+EdgeFunction Rasterizer::MakeEdgeFunction(std::int64_t ax, std::int64_t ay, std::int64_t bx, std::int64_t by)
+{
+	const std::int64_t a = by - ay;
+	const std::int64_t b = ax - bx;
+	std::int64_t c = -(a * ax + b * ay);
 
-#pragma region Optimisation (BoundingBox on Triangle)
+	// Top-left fill rule: a sample exactly on the edge is inside only if the edge is a left one (inside towards +x)
+	// or a horizontal top one (inside towards +y). Edges are exact integers, so a bias of 1 turns ">= 0" into "> 0"
+	if (a > 0 || (a == 0 && b > 0))
+		c += 1;
+
+	// Per pixel steps, and the value at the center of pixel (0, 0)
+	const std::int64_t unit = std::int64_t(1) << SUBPIXEL_BITS;
+	EdgeFunction edge;
+	edge.stepX = a * unit;
+	edge.stepY = b * unit;
+	edge.origin = c + (a + b) * (unit / 2);
+	return edge;
+}
+
+bool Rasterizer::SetupTriangle(const SetupVertex& v0, const SetupVertex& v1, const SetupVertex& v2, Texture* pTexture, TriangleSetup& setup)
+{
+	const glm::vec4& v0Homogen = v0.pos;
+	const glm::vec4& v1Homogen = v1.pos;
+	const glm::vec4& v2Homogen = v2.pos;
 
-			float valueX1 = M[0].x / M[2].x;
-			float valueX2 = M[0].y / M[2].y;
-			float valueX3 = M[0].z / M[2].z;
+	// Clipping against the near plane guarantees w > 0, and the guard band keeps the projected values in range.
+	// Projected vertices are snapped to the sub-pixel grid, coverage is then decided with exact integer math
+	const float oneOverW[3] = { 1.0f / v0Homogen.w, 1.0f / v1Homogen.w, 1.0f / v2Homogen.w };
+	const glm::vec4* positions[3] = { &v0Homogen, &v1Homogen, &v2Homogen };
+	const double subpixelScale = static_cast<double>(1 << SUBPIXEL_BITS);
+	std::int64_t X[3];
+	std::int64_t Y[3];
+	for (int i = 0; i < 3; i++)
+	{
+		X[i] = std::llround(static_cast<double>(positions[i]->x * oneOverW[i]) * subpixelScale);
+		Y[i] = std::llround(static_cast<double>(positions[i]->y * oneOverW[i]) * subpixelScale);
+	}
+
+	// w > 0, so the sign of det(M) is the one of the projected area: a zero area is a degenerate triangle and a
+	// positive one a back-facing triangle, we're going to skip such primitives. Testing the snapped area is exact and
+	// also catches sliver triangles collapsed or flipped by snapping
+	if ((X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]) >= 0)
+		return false;
+
+#pragma region Optimisation (BoundingBox on Triangle)
 
-			float valueY1 = M[1].x / M[2].x;
-			float valueY2 = M[1].y / M[2].y;
-			float valueY3 = M[1].z / M[2].z;
+	//Create a "Bounding Box" of the pixels whose center may be covered, to only loop over them when doing the EdgeEval
+	const std::int64_t halfPixel = std::int64_t(1) << (SUBPIXEL_BITS - 1);
+	const std::int64_t lastSubpixel = (std::int64_t(1) << SUBPIXEL_BITS) - 1;
+	const std::int64_t minTriWidth = (std::min({ X[0], X[1], X[2] }) - halfPixel + lastSubpixel) >> SUBPIXEL_BITS;
+	const std::int64_t maxTriWidth = ((std::max({ X[0], X[1], X[2] }) - halfPixel) >> SUBPIXEL_BITS) + 1;
+	const std::int64_t minTriHeight = (std::min({ Y[0], Y[1], Y[2] }) - halfPixel + lastSubpixel) >> SUBPIXEL_BITS;
+	const std::int64_t maxTriHeight = ((std::max({ Y[0], Y[1], Y[2] }) - halfPixel) >> SUBPIXEL_BITS) + 1;
 
-			//Create a "Bounding Box" to only loop over pixels in it when doing the EdgeEval
-			int minTriWidth = static_cast<int>(std::min({ valueX1, valueX2, valueX3 }));
-			int maxTriWidth = static_cast<int>(std::max({ valueX1, valueX2, valueX3 }));
-			int minTriHeight = static_cast<int>(std::min({ valueY1, valueY2, valueY3 }));
-			int maxTriHeight = static_cast<int>(std::max({ valueY1, valueY2, valueY3 }));
+	setup.minX = static_cast<std::int32_t>(std::clamp<std::int64_t>(minTriWidth, 0, m_ScreenWidth));
+	setup.maxX = static_cast<std::int32_t>(std::clamp<std::int64_t>(maxTriWidth, 0, m_ScreenWidth));
+	setup.minY = static_cast<std::int32_t>(std::clamp<std::int64_t>(minTriHeight, 0, m_ScreenHeight));
+	setup.maxY = static_cast<std::int32_t>(std::clamp<std::int64_t>(maxTriHeight, 0, m_ScreenHeight));
 
+	// No pixel center in the bounding box: dropped before any interpolation setup. Most sub-pixel triangles end here
+	if (setup.minX >= setup.maxX || setup.minY >= setup.maxY)
+		return false;
 
-			minTriWidth = std::clamp(minTriWidth, 0, static_cast<int>(m_ScreenWidth));
-			maxTriWidth = std::clamp(maxTriWidth, 0, static_cast<int>(m_ScreenWidth));
-			minTriHeight = std::clamp(minTriHeight, 0, static_cast<int>(m_ScreenHeight));
-			maxTriHeight = std::clamp(maxTriHeight, 0, static_cast<int>(m_ScreenHeight));
+	// Edge functions from the snapped vertices, each one opposite to the vertex of the same index
+	setup.E0 = MakeEdgeFunction(X[1], Y[1], X[2], Y[2]);
+	setup.E1 = MakeEdgeFunction(X[2], Y[2], X[0], Y[0]);
+	setup.E2 = MakeEdgeFunction(X[0], Y[0], X[1], Y[1]);
 
 #pragma endregion
-			
-			// Compute the inverse of vertex matrix to use it for setting up edge & constant functions
-			M = inverse(M);
-
-			// Set up edge functions based on the vertex matrix
-			// We also apply some scaling to edge functions to be more robust.
-			// This is fine, as we are working with homogeneous coordinates and do not disturb the sign of these functions.
-			glm::vec3 E0 = M[0] / (glm::abs(M[0].x) + glm::abs(M[0].y));
-			glm::vec3 E1 = M[1] / (glm::abs(M[1].x) + glm::abs(M[1].y));
-			glm::vec3 E2 = M[2] / (glm::abs(M[2].x) + glm::abs(M[2].y));
-
-			// Calculate constant function to interpolate 1/w
-			glm::vec3 C = M * glm::vec3(1, 1, 1);
-
-			// Calculate z interpolation vector
-			glm::vec3 Z = M * glm::vec3(v0Clip.z, v1Clip.z, v2Clip.z);
-
-			// Calculate normal interpolation vector
-			glm::vec3 PNX = M * glm::vec3(vi0.normal.x, vi1.normal.x, vi2.normal.x);
-			glm::vec3 PNY = M * glm::vec3(vi0.normal.y, vi1.normal.y, vi2.normal.y);
-			glm::vec3 PNZ = M * glm::vec3(vi0.normal.z, vi1.normal.z, vi2.normal.z);
-
-			// Calculate UV interpolation vector
-			glm::vec3 PUVertexShader = M * glm::vec3(vi0.texCoords.s, vi1.texCoords.s, vi2.texCoords.s);
-			glm::vec3 PUVT = M * glm::vec3(vi0.texCoords.t, vi1.texCoords.t, vi2.texCoords.t);
-
-			// Start rasterizing by looping over pixels in the bounding box to output a per-pixel color
-			#pragma omp parallel for collapse(2) schedule(dynamic)
-			for (auto y = minTriHeight; y < maxTriHeight; y++)
+
+	// Value of each attribute at the three vertices: 1/w comes from constant ones, then z, normal and UV
+	const glm::vec3 attributes[ATTRIBUTE_COUNT] =
+	{
+		glm::vec3(1, 1, 1),
+		glm::vec3(v0Homogen.z, v1Homogen.z, v2Homogen.z),
+		glm::vec3(v0.normal.x, v1.normal.x, v2.normal.x),
+		glm::vec3(v0.normal.y, v1.normal.y, v2.normal.y),
+		glm::vec3(v0.normal.z, v1.normal.z, v2.normal.z),
+		glm::vec3(v0.texCoords.s, v1.texCoords.s, v2.texCoords.s),
+		glm::vec3(v0.texCoords.t, v1.texCoords.t, v2.texCoords.t),
+	};
+
+	if (setup.maxX - setup.minX <= SMALL_TRIANGLE_SIZE && setup.maxY - setup.minY <= SMALL_TRIANGLE_SIZE)
+	{
+		// Small triangle: the edge functions already are its barycentric coordinates up to a scale, the weight of
+		// vertex i at a sample being Ei / (E0 + E1 + E2). Weights are taken at the first pixel of the bounding box,
+		// where they are small exact integers, and scaled by 1/w so that attributes over w come out of a dot product
+		const std::int64_t e0 = setup.E0.Evaluate(setup.minX, setup.minY);
+		const std::int64_t e1 = setup.E1.Evaluate(setup.minX, setup.minY);
+		const std::int64_t e2 = setup.E2.Evaluate(setup.minX, setup.minY);
+		const float oneOverArea = 1.0f / static_cast<float>(e0 + e1 + e2);
+		auto toWeights = [oneOverArea](std::int64_t a, std::int64_t b, std::int64_t c)
+		{
+			return glm::vec3(static_cast<float>(a), static_cast<float>(b), static_cast<float>(c)) * oneOverArea;
+		};
+		const glm::vec3 weightDx = toWeights(setup.E0.stepX, setup.E1.stepX, setup.E2.stepX);
+		const glm::vec3 weightDy = toWeights(setup.E0.stepY, setup.E1.stepY, setup.E2.stepY);
+		const glm::vec3 weight = toWeights(e0, e1, e2);
+		const glm::vec3 perspective(oneOverW[0], oneOverW[1], oneOverW[2]);
+
+		const float minX = static_cast<float>(setup.minX);
+		const float minY = static_cast<float>(setup.minY);
+		for (std::uint32_t attribute = 0; attribute < ATTRIBUTE_COUNT; attribute++)
+		{
+			const glm::vec3 overW = attributes[attribute] * perspective;
+			const float dx = glm::dot(weightDx, overW);
+			const float dy = glm::dot(weightDy, overW);
+			setup.gradients.dx[attribute] = dx;
+			setup.gradients.dy[attribute] = dy;
+			setup.gradients.start[attribute] = glm::dot(weight, overW) - dx * minX - dy * minY;
+		}
+	}
+	else
+	{
+		// Base vertex matrix, relative to the center of the first pixel of the bounding box: its entries stay of the
+		// size of the triangle instead of the distance to the screen origin, which keeps the inverse accurate
+		const float originX = static_cast<float>(setup.minX) + 0.5f;
+		const float originY = static_cast<float>(setup.minY) + 0.5f;
+		const glm::mat3 M =
+		{
+			// Notice that glm is itself column-major)
+			{ v0Homogen.x - originX * v0Homogen.w, v1Homogen.x - originX * v1Homogen.w, v2Homogen.x - originX * v2Homogen.w},
+			{ v0Homogen.y - originY * v0Homogen.w, v1Homogen.y - originY * v1Homogen.w, v2Homogen.y - originY * v2Homogen.w},
+			{ v0Homogen.w, v1Homogen.w, v2Homogen.w},
+		};
+
+		// Compute the inverse of vertex matrix to use it for setting up the interpolation functions
+		const glm::mat3 inverseM = inverse(M);
+
+		// Interpolation vector (a, b, c) of each attribute, a * x + b * y + c being the attribute over w at raster
+		// position (x, y) relative to the origin. Gradient record: per pixel steps, and start values moved to the
+		// center of pixel (0, 0)
+		const float minX = static_cast<float>(setup.minX);
+		const float minY = static_cast<float>(setup.minY);
+		for (std::uint32_t attribute = 0; attribute < ATTRIBUTE_COUNT; attribute++)
+		{
+			const glm::vec3 plane = inverseM * attributes[attribute];
+			setup.gradients.dx[attribute] = plane.x;
+			setup.gradients.dy[attribute] = plane.y;
+			setup.gradients.start[attribute] = plane.z - plane.x * minX - plane.y * minY;
+		}
+	}
+
+	// Perspective correct z stays between the vertices ones
+	setup.minZ = std::min({ v0Homogen.z, v1Homogen.z, v2Homogen.z });
+	setup.maxZ = std::max({ v0Homogen.z, v1Homogen.z, v2Homogen.z });
+
+	setup.pTexture = pTexture;
+
+	return true;
+}
+
+std::uint32_t Rasterizer::SetupTriangleBatchScalar(const TriangleBatch& batch, TriangleSetup* pSetups)
+{
+	std::uint32_t count = 0u;
+	for (std::uint32_t i = 0; i < batch.count; i++)
+	{
+		const SetupVertex (&vertices)[3] = batch.vertices[i];
+		if (SetupTriangle(vertices[0], vertices[1], vertices[2], batch.pTexture, pSetups[count]))
+			pSetups[count++].id = batch.ids[i];
+	}
+	return count;
+}
+
+VertexInput Rasterizer::InterpolateAttributes(const float (&values)[AttributeGradients::PADDED_COUNT], float w)
+{
+	VertexInput vertexInput;
+	vertexInput.normal = glm::vec3(values[ATTRIBUTE_NX], values[ATTRIBUTE_NY], values[ATTRIBUTE_NZ]) * w;
+	vertexInput.texCoords = glm::vec2(values[ATTRIBUTE_U], values[ATTRIBUTE_V]) * w;
+	return vertexInput;
+}
+
+int Rasterizer::ComputeMipLevel(const TriangleSetup& setup, const glm::vec2& texCoords, float w)
+{
+	// Derivatives of the texture coordinates along x and y, in texels of level 0
+	const float width = static_cast<float>(setup.pTexture->width);
+	const float height = static_cast<float>(setup.pTexture->height);
+	const AttributeGradients& gradients = setup.gradients;
+	const float dudx = w * (gradients.dx[ATTRIBUTE_U] - texCoords.s * gradients.dx[ATTRIBUTE_ONE_OVER_W]) * width;
+	const float dvdx = w * (gradients.dx[ATTRIBUTE_V] - texCoords.t * gradients.dx[ATTRIBUTE_ONE_OVER_W]) * height;
+	const float dudy = w * (gradients.dy[ATTRIBUTE_U] - texCoords.s * gradients.dy[ATTRIBUTE_ONE_OVER_W]) * width;
+	const float dvdy = w * (gradients.dy[ATTRIBUTE_V] - texCoords.t * gradients.dy[ATTRIBUTE_ONE_OVER_W]) * height;
+
+	// Squared length of the largest footprint, magnified surfaces use level 0
+	const float rho2 = std::max({ dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy, 1.0f });
+
+	// The level is round(log2(rho)) = round(log2(rho2) / 2) = (floor(log2(rho2)) + 1) / 2,
+	// floor(log2(rho2)) being the float exponent: no log2 call per fragment
+	const int exponent = static_cast<int>(std::bit_cast<std::uint32_t>(rho2) >> 23) - 127;
+	return (exponent + 1) >> 1;
+}
+
+std::uint32_t Rasterizer::ResolveVisibility(std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("Resolve");
+#endif
+	std::uint32_t shaded = 0u;
+	for (auto y = minY; y < maxY; y++)
+	{
+		for (auto x = minX; x < maxX; x++)
+		{
+			const int index = x + y * m_ScreenWidth;
+			const std::uint32_t id = m_VisibilityBuffer[index];
+			if (id == INVALID_TRIANGLE)
+				continue;
+
+			// Reconstruct the attributes of the visible triangle at this pixel, then shade it once
+			const TriangleSetup& setup = m_Triangles[id];
+			float values[AttributeGradients::PADDED_COUNT];
+			for (std::uint32_t attribute = 0; attribute < AttributeGradients::PADDED_COUNT; attribute++)
+				values[attribute] = setup.gradients.Evaluate(attribute, x, y);
+			float w = 1.f / values[ATTRIBUTE_ONE_OVER_W];
+
+			const VertexInput vertexInput = InterpolateAttributes(values, w);
+			WriteColor(index, FragmentShader(vertexInput, setup.pTexture, ComputeMipLevel(setup, vertexInput.texCoords, w)));
+			shaded++;
+		}
+	}
+	return shaded;
+}
+
+bool Rasterizer::IsOccluded(const TriangleSetup& setup)
+{
+	// Use the finest level where the bounding box only spans a handful of cells
+	std::uint32_t level = 0;
+	std::uint32_t cellMinX, cellMaxX, cellMinY, cellMaxY;
+	for (;; level++)
+	{
+		const std::uint32_t cellSize = BLOCK_SIZE << level;
+		cellMinX = setup.minX / cellSize;
+		cellMaxX = (setup.maxX - 1) / cellSize;
+		cellMinY = setup.minY / cellSize;
+		cellMaxY = (setup.maxY - 1) / cellSize;
+		if (level == HIZ_LEVELS - 1 || (cellMaxX - cellMinX + 1) * (cellMaxY - cellMinY + 1) <= 16)
+			break;
+	}
+
+	// Occluded only if every cell is already nearer than the nearest point of the triangle
+	for (std::uint32_t cellY = cellMinY; cellY <= cellMaxY; cellY++)
+		for (std::uint32_t cellX = cellMinX; cellX <= cellMaxX; cellX++)
+			if (setup.minZ <= std::atomic_ref<float>(m_HiZ[level][cellY * m_HiZWidth[level] + cellX]).load(std::memory_order_relaxed))
+				return false;
+
+	return true;
+}
+
+void Rasterizer::UpdateHiZ(std::uint32_t blockX, std::uint32_t blockY, float depth)
+{
+	// Cells of the upper levels are shared between the bands of the immediate mode: relaxed atomics are enough
+	// as a concurrently computed maximum can only be too far, which stays conservative
+	std::atomic_ref<float> cell(m_HiZ[0][blockY * m_HiZWidth[0] + blockX]);
+	if (depth >= cell.load(std::memory_order_relaxed))
+		return;
+	cell.store(depth, std::memory_order_relaxed);
+
+	for (std::uint32_t level = 1; level < HIZ_LEVELS; level++)
+	{
+		const std::uint32_t childX = blockX & ~1u;
+		const std::uint32_t childY = blockY & ~1u;
+		blockX /= 2;
+		blockY /= 2;
+
+		// Farthest of the (up to) four children, the last row/column of a level may lack some of them
+		float farthest = 0.0f;
+		for (std::uint32_t y = childY; y < std::min(childY + 2, m_HiZHeight[level - 1]); y++)
+			for (std::uint32_t x = childX; x < std::min(childX + 2, m_HiZWidth[level - 1]); x++)
+				farthest = std::max(farthest, std::atomic_ref<float>(m_HiZ[level - 1][y * m_HiZWidth[level - 1] + x]).load(std::memory_order_relaxed));
+
+		std::atomic_ref<float> parent(m_HiZ[level][blockY * m_HiZWidth[level] + blockX]);
+		if (farthest >= parent.load(std::memory_order_relaxed))
+			return;
+		parent.store(farthest, std::memory_order_relaxed);
+	}
+}
+
+BlockCoverage Rasterizer::ClassifyBlock(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY)
+{
+	// Edge functions are linear over the screen, so their extremes over the block are reached at its corner samples
+	const std::int32_t x0 = minX;
+	const std::int32_t x1 = maxX - 1;
+	const std::int32_t y0 = minY;
+	const std::int32_t y1 = maxY - 1;
+
+	// Lowest and highest value of an edge function over the block
+	auto edgeMin = [&](const EdgeFunction& E) { return E.Evaluate(E.stepX > 0 ? x0 : x1, E.stepY > 0 ? y0 : y1); };
+	auto edgeMax = [&](const EdgeFunction& E) { return E.Evaluate(E.stepX > 0 ? x1 : x0, E.stepY > 0 ? y1 : y0); };
+
+	// No sample of the block is inside one of the edges
+	if (edgeMax(setup.E0) <= 0 || edgeMax(setup.E1) <= 0 || edgeMax(setup.E2) <= 0)
+		return BlockCoverage::Outside;
+
+	if (edgeMin(setup.E0) > 0 && edgeMin(setup.E1) > 0 && edgeMin(setup.E2) > 0)
+		return BlockCoverage::Inside;
+
+	return BlockCoverage::Partial;
+}
+
+std::uint32_t Rasterizer::RasterizeTriangle(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY)
+{
+	// Small regions are a handful of pixels, testing them all is cheaper than classifying blocks first.
+	// They can never cover a whole 8x8 block, so there is no Hi-Z to update either
+	if (maxX - minX <= SMALL_TRIANGLE_SIZE && maxY - minY <= SMALL_TRIANGLE_SIZE)
+		return (this->*m_RasterizePartialBlock)(setup, minX, maxX, minY, maxY);
+
+	std::uint32_t fragments = 0u;
+	constexpr std::int32_t blockSize = static_cast<std::int32_t>(BLOCK_SIZE);
+	constexpr std::int32_t subBlockSize = static_cast<std::int32_t>(SUB_BLOCK_SIZE);
+
+	// Blocks are aligned on the screen grid, the ones on the border of the region are cut down to it
+	for (std::int32_t blockY = minY & ~(blockSize - 1); blockY < maxY; blockY += blockSize)
+	{
+		const std::int32_t y0 = std::max(blockY, minY);
+		const std::int32_t y1 = std::min(blockY + blockSize, maxY);
+
+		for (std::int32_t blockX = minX & ~(blockSize - 1); blockX < maxX; blockX += blockSize)
+		{
+			const std::int32_t x0 = std::max(blockX, minX);
+			const std::int32_t x1 = std::min(blockX + blockSize, maxX);
+
+			// Hi-Z: everything in the block is already nearer than the triangle
+			const std::uint32_t hiZX = blockX / blockSize;
+			const std::uint32_t hiZY = blockY / blockSize;
+			if (setup.minZ > std::atomic_ref<float>(m_HiZ[0][hiZY * m_HiZWidth[0] + hiZX]).load(std::memory_order_relaxed))
+				continue;
+
+			switch (ClassifyBlock(setup, x0, x1, y0, y1))
 			{
+			case BlockCoverage::Outside:
+				break;
+			case BlockCoverage::Inside:
+				fragments += (this->*m_RasterizeInsideBlock)(setup, x0, x1, y0, y1);
+
+				// Every pixel of the block now holds a depth no farther than the triangle's farthest point
+				if (x0 == blockX && y0 == blockY &&
+					x1 == std::min(blockX + blockSize, static_cast<std::int32_t>(m_ScreenWidth)) &&
+					y1 == std::min(blockY + blockSize, static_cast<std::int32_t>(m_ScreenHeight)))
+				{
+					UpdateHiZ(hiZX, hiZY, setup.maxZ);
+				}
+				break;
+			case BlockCoverage::Partial:
+				// A row of an 8x8 block is a single step of the SIMD kernel, refining only pays off for the scalar one
+				if (!m_RefineBlocks)
+				{
+					fragments += (this->*m_RasterizePartialBlock)(setup, x0, x1, y0, y1);
+					break;
+				}
+
+				// Refine the 8x8 block into 4x4 ones before going down to per pixel coverage
+				for (std::int32_t subY = blockY; subY < y1; subY += subBlockSize)
+				{
+					const std::int32_t sy0 = std::max(subY, y0);
+					const std::int32_t sy1 = std::min(subY + subBlockSize, y1);
+					if (sy0 >= sy1)
+						continue;
+
+					for (std::int32_t subX = blockX; subX < x1; subX += subBlockSize)
+					{
+						const std::int32_t sx0 = std::max(subX, x0);
+						const std::int32_t sx1 = std::min(subX + subBlockSize, x1);
+						if (sx0 >= sx1)
+							continue;
+
+						switch (ClassifyBlock(setup, sx0, sx1, sy0, sy1))
+						{
+						case BlockCoverage::Outside:
+							break;
+						case BlockCoverage::Inside:
+							fragments += (this->*m_RasterizeInsideBlock)(setup, sx0, sx1, sy0, sy1);
+							break;
+						case BlockCoverage::Partial:
+							fragments += (this->*m_RasterizePartialBlock)(setup, sx0, sx1, sy0, sy1);
+							break;
+						}
+					}
+				}
+				break;
+			}
+		}
+	}
+	return fragments;
+}
+
+template<bool TestCoverage>
+std::uint32_t Rasterizer::RasterizeBlockScalar(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY)
+{
+	std::uint32_t fragments = 0u;
+	const AttributeGradients& gradients = setup.gradients;
+
+	// Attributes at the first pixel of the block, every pixel after that is one add per attribute away
+	float rowValues[AttributeGradients::PADDED_COUNT];
+	for (std::uint32_t attribute = 0; attribute < AttributeGradients::PADDED_COUNT; attribute++)
+		rowValues[attribute] = gradients.Evaluate(attribute, minX, minY);
+
+	for (auto y = minY; y < maxY; y++)
+	{
 #if TRACY_ENABLE
-				ZoneScopedN("EdgeEval");
+		ZoneScopedN("EdgeEval");
 #endif
 
-				//Evaluate Edge for the x0,y (instead of scanline we use Incremental edge func.)
-				glm::vec2 sample = { minTriWidth + 0.5f , y + 0.5f };
-				float Ei1 = EvaluateEdgeFunction(E0, sample);
-				float Ei2 = EvaluateEdgeFunction(E1, sample);
-				float Ei3 = EvaluateEdgeFunction(E2, sample);
+		//Evaluate Edge for the x0,y (instead of scanline we use Incremental edge func.), exact integer steps from there
+		std::int64_t Ei1 = setup.E0.Evaluate(minX, y);
+		std::int64_t Ei2 = setup.E1.Evaluate(minX, y);
+		std::int64_t Ei3 = setup.E2.Evaluate(minX, y);
 
-				for (auto x = minTriWidth; x < maxTriWidth; x++)
+		float values[AttributeGradients::PADDED_COUNT];
+		std::copy(std::begin(rowValues), std::end(rowValues), values);
+
+		for (auto x = minX; x < maxX; x++)
+		{
+			// If sample is "inside" of all three half-spaces bounded by the three edges of the triangle, it's 'on' the triangle
+			// (always the case in blocks classified as inside)
+			if (!TestCoverage || (Ei1 > 0 && Ei2 > 0 && Ei3 > 0))
+			{
+				// w = 1/(1/w), the only division per fragment
+				float w = 1.f / values[ATTRIBUTE_ONE_OVER_W];
+
+				// z that will be used for depth test
+				float z = values[ATTRIBUTE_Z] * w;
+
+				int index = x + y * m_ScreenWidth;
+				if (z <= m_DepthBuffer[index])
 				{
-					// Sample location at the center of each pixel
-					glm::vec2 sample = { x + 0.5f, y + 0.5f };
+					// Depth test passed; update depth buffer value
+					m_DepthBuffer[index] = z;
+					fragments++;
 
-					// If sample is "inside" of all three half-spaces bounded by the three edges of the triangle, it's 'on' the triangle
-					if (Ei1 > 0.0f && Ei2 > 0.0f && Ei3 > 0.0f)
+					if (m_ShadingMode == ShadingMode::Visibility)
 					{
-						// Interpolate 1/w at current fragment
-						float oneOverW = (C.x * sample.x) + (C.y * sample.y) + C.z;
+						// Only remember which triangle is visible, it gets shaded once in ResolveVisibility
+						m_VisibilityBuffer[index] = setup.id;
+					}
+					else
+					{
+						// Invoke fragment shader to output a color for each fragment
+						const VertexInput vertexInput = InterpolateAttributes(values, w);
+						glm::vec3 outputColor = FragmentShader(vertexInput, setup.pTexture, ComputeMipLevel(setup, vertexInput.texCoords, w));
 
-						// w = 1/(1/w)
-						float w = 1.f / oneOverW;
+						// Write new color at this fragment
+						WriteColor(index, outputColor);
+					}
+				}
+			}
+			//Increment Egde position and attributes for all x on the y scanline (Incremental edge func.)
+			Ei1 += setup.E0.stepX;
+			Ei2 += setup.E1.stepX;
+			Ei3 += setup.E2.stepX;
+			for (std::uint32_t attribute = 0; attribute < AttributeGradients::PADDED_COUNT; attribute++)
+				values[attribute] += gradients.dx[attribute];
+		}
 
-						// Interpolate z that will be used for depth test
-						float zOverW = (Z.x * sample.x) + (Z.y * sample.y) + Z.z;
-						float z = zOverW * w;
+		for (std::uint32_t attribute = 0; attribute < AttributeGradients::PADDED_COUNT; attribute++)
+			rowValues[attribute] += gradients.dy[attribute];
+	}
+	return fragments;
+}
 
-						int index = x + y * m_ScreenWidth;
-						if (z <= m_DepthBuffer[index])
-						{
-							// Depth test passed; update depth buffer value
-							m_DepthBuffer[index] = z;
+void Rasterizer::TransformScene()
+{
+	BeginFrame(m_Scene.GetCamera());
+	Render();
+	EndFrame();
+}
 
-							// Interpolate normal
-							float nxOverW = (PNX.x * sample.x) + (PNX.y * sample.y) + PNX.z;
-							float nyOverW = (PNY.x * sample.x) + (PNY.y * sample.y) + PNY.z;
-							float nzOverW = (PNZ.x * sample.x) + (PNZ.y * sample.y) + PNZ.z;
+void Rasterizer::BeginFrame(const Camera& camera)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("BeginFrame");
+#endif
+	assert(!m_IsInFrame && "BeginFrame called twice without EndFrame!");
+	m_IsInFrame = true;
 
-							// Interpolate texture coordinates
-							float uOverW = (PUVertexShader.x * sample.x) + (PUVertexShader.y * sample.y) + PUVertexShader.z;
-							float vOverW = (PUVT.x * sample.x) + (PUVT.y * sample.y) + PUVT.z;
+	m_Scene.SetCamera(camera);
+	m_Stats = RenderStats();
 
-							VertexInput vertexInput;
-							vertexInput.normal = glm::vec3(nxOverW, nyOverW, nzOverW) * w;
-							vertexInput.texCoords = glm::vec2(uOverW, vOverW) * w;
+	// The visibility buffer only lives while visibility shading is selected
+	if (m_ShadingMode == ShadingMode::Visibility)
+	{
+		m_VisibilityBuffer.resize(m_ScreenWidth * m_ScreenHeight);
+	}
+	else
+	{
+		m_VisibilityBuffer.clear();
+		m_VisibilityBuffer.shrink_to_fit();
+	}
+	ClearBuffers();
+}
 
-							// Invoke fragment shader to output a color for each fragment
-							Texture* pTexture = m_Scene.textures.at(m_Scene.primitives[i].diffuseTexName);
-							glm::vec3 outputColor = FragmentShader(vertexInput, pTexture);
+void Rasterizer::Render()
+{
+	assert(m_IsInFrame && "Render called outside of BeginFrame/EndFrame!");
+	assert((m_ShadingMode == ShadingMode::Forward || m_VisibilityBuffer.size() == m_ScreenWidth * m_ScreenHeight) && "Shading mode changed during the frame!");
 
-							// Write new color at this fragment
-							m_FrameBuffer[index] = outputColor;
-						}
+	TransformVertices();
+	CullClusters();
+
+	switch (m_RenderMode)
+	{
+	case RenderMode::Immediate:
+		TransformSceneImmediate();
+		break;
+	case RenderMode::Tiled:
+		TransformSceneTiled();
+		break;
+	}
+}
+
+void Rasterizer::EndFrame()
+{
+#if TRACY_ENABLE
+	ZoneScopedN("EndFrame");
+#endif
+	assert(m_IsInFrame && "EndFrame called without BeginFrame!");
+	m_IsInFrame = false;
+
+	if (m_ShadingMode == ShadingMode::Forward)
+		m_Stats.shadedFragments = m_Stats.depthPassedFragments;
+
+	std::atomic<std::uint64_t> coveredPixels = 0u;
+	m_Scheduler.ParallelFor(0u, static_cast<std::uint32_t>(m_DepthBuffer.size()), PIXEL_GRAIN, [&](std::uint32_t begin, std::uint32_t end)
+	{
+		const std::uint64_t covered = std::count_if(m_DepthBuffer.begin() + begin, m_DepthBuffer.begin() + end, [](float z) { return z != FLT_MAX; });
+		coveredPixels.fetch_add(covered, std::memory_order_relaxed);
+	});
+	m_Stats.coveredPixels = coveredPixels.load(std::memory_order_relaxed);
+}
+
+std::uint32_t Rasterizer::RasterizeTriangleImmediate(const TriangleSetup& setup)
+{
+	if (IsOccluded(setup))
+	{
+		m_Stats.occludedTriangles++;
+		return 0u;
+	}
+
+	// Start rasterizing the bounding box, one band of blocks per task to output a per-pixel color.
+	// Triangles spanning a single band are rasterized right here without involving the other workers
+	std::atomic<std::uint32_t> fragments = 0u;
+	const std::uint32_t firstBand = static_cast<std::uint32_t>(setup.minY) / BLOCK_SIZE;
+	const std::uint32_t lastBand = static_cast<std::uint32_t>(setup.maxY - 1) / BLOCK_SIZE;
+	m_Scheduler.ParallelFor(firstBand, lastBand + 1, 1u, [&](std::uint32_t begin, std::uint32_t end)
+	{
+		fragments.fetch_add(RasterizeTriangle(setup, setup.minX, setup.maxX,
+			std::max(static_cast<std::int32_t>(begin * BLOCK_SIZE), setup.minY), std::min(static_cast<std::int32_t>(end * BLOCK_SIZE), setup.maxY)),
+			std::memory_order_relaxed);
+	});
+	return fragments.load(std::memory_order_relaxed);
+}
+
+void Rasterizer::TransformSceneImmediate()
+{
+	const bool deferred = m_ShadingMode == ShadingMode::Visibility;
+
+	// Deferred shading needs the set up triangles until the end of the frame, the pieces of clipped ones are appended.
+	// Triangles are identified by their position in the index buffer
+	if (deferred)
+		m_Triangles.resize(m_Scene.indexBuffer.size() / 3);
+
+	// Triangles needing no clipping are set up a batch at a time, then rasterized in submission order
+	TriangleBatch batch;
+	TriangleSetup setups[TriangleBatch::SIZE];
+	std::uint64_t fragments = 0u;
+	auto flushBatch = [&]()
+	{
+		const std::uint32_t count = batch.count > 0u ? (this->*m_SetupTriangleBatch)(batch, setups) : 0u;
+		for (std::uint32_t k = 0; k < count; k++)
+		{
+			TriangleSetup& setup = deferred ? (m_Triangles[setups[k].id] = setups[k]) : setups[k];
+			fragments += RasterizeTriangleImmediate(setup);
+		}
+		batch.count = 0u;
+	};
+
+	std::uint32_t currentMesh = UINT32_MAX;
+	Texture* pTexture = nullptr;
+	for (size_t i = 0; i < m_Scene.clusters.size(); i++)
+	{
+#if TRACY_ENABLE
+		ZoneScopedN("Clusters");
+#endif
+		if (!m_ClusterVisible[i])
+			continue;
+
+		// Resolve the texture once per mesh, from its material handle
+		const Cluster& cluster = m_Scene.clusters[i];
+		if (cluster.mesh != currentMesh)
+		{
+			currentMesh = cluster.mesh;
+			pTexture = m_Scene.materials[m_Scene.primitives[currentMesh].materialIdx].pDiffuse;
+		}
+		batch.pTexture = pTexture;
+
+		// Loop over triangles of the cluster and rasterize them
+		const std::uint32_t firstTriangle = cluster.idxOffset / 3;
+		for (std::uint32_t triangle = firstTriangle; triangle < firstTriangle + cluster.triangleCount; triangle++)
+		{
+#if TRACY_ENABLE
+			ZoneScopedN("Tri Calculations");
+#endif
+			// Fetched straight into the next slot of the batch, which is only taken if the triangle needs no clipping
+			SetupVertex (&vertices)[3] = batch.vertices[batch.count];
+			FetchTriangle(triangle, vertices);
+
+			switch (ClassifyTriangle(vertices))
+			{
+			case TriangleClip::Rejected:
+				break;
+			case TriangleClip::Inside:
+				batch.ids[batch.count++] = triangle;
+				if (batch.count == TriangleBatch::SIZE)
+					flushBatch();
+				break;
+			case TriangleClip::Clipped:
+			{
+				// Previous triangles first, depth ties resolve in submission order. Flushing leaves the vertices as they are
+				flushBatch();
+
+				// Fan triangulation of the clipped polygon
+				SetupVertex polygon[MAX_CLIPPED_VERTICES];
+				const std::uint32_t count = ClipTriangle(vertices, polygon);
+				for (std::uint32_t k = 1; k + 1 < count; k++)
+				{
+					TriangleSetup setup;
+					if (!SetupTriangle(polygon[0], polygon[k], polygon[k + 1], pTexture, setup))
+						continue;
+
+					if (deferred)
+					{
+						setup.id = static_cast<std::uint32_t>(m_Triangles.size());
+						m_Triangles.push_back(setup);
 					}
-					//Increment Egde position for all x on the y scanline (Incremental edge func.)
-					Ei1 += E0.x;
-					Ei2 += E1.x;
-					Ei3 += E2.x;
+					fragments += RasterizeTriangleImmediate(setup);
 				}
+				break;
+			}
 			}
 		}
+
+		// The next cluster may use another texture
+		flushBatch();
+	}
+	m_Stats.depthPassedFragments = fragments;
+
+	// Second pass of deferred shading, once every triangle has been rasterized
+	if (deferred)
+	{
+		std::atomic<std::uint64_t> shaded = 0u;
+		const std::uint32_t bandCount = (m_ScreenHeight + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		m_Scheduler.ParallelFor(0u, bandCount, 1u, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			shaded.fetch_add(ResolveVisibility(0, m_ScreenWidth, begin * BLOCK_SIZE, std::min(end * BLOCK_SIZE, m_ScreenHeight)),
+				std::memory_order_relaxed);
+		});
+		m_Stats.shadedFragments = shaded.load(std::memory_order_relaxed);
 	}
 }
 
-void Rasterizer::RenderToPng(const std::string_view filename)
+void Rasterizer::TransformSceneTiled()
 {
-	assert(m_FrameBuffer.size() >= (m_ScreenWidth * m_ScreenHeight));
+	// Triangles are identified by their position in the index buffer
+	const std::uint32_t triangleCount = static_cast<std::uint32_t>(m_Scene.indexBuffer.size() / 3);
+	m_Triangles.resize(triangleCount);
+	m_TriangleVisible.assign(triangleCount, SETUP_CULLED);
+
+	// Geometry phase: set up every triangle of the visible clusters, keeping the submission order
+	std::atomic<std::uint32_t> clippedCount = 0u;
+	{
+#if TRACY_ENABLE
+		ZoneScopedN("Setup");
+#endif
+		m_Scheduler.ParallelFor(0u, static_cast<std::uint32_t>(m_Scene.clusters.size()), 1u, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			// Triangles needing no clipping are set up a batch at a time
+			TriangleBatch batch;
+			TriangleSetup setups[TriangleBatch::SIZE];
+			auto flushBatch = [&]()
+			{
+				const std::uint32_t count = batch.count > 0u ? (this->*m_SetupTriangleBatch)(batch, setups) : 0u;
+				for (std::uint32_t k = 0; k < count; k++)
+				{
+					m_Triangles[setups[k].id] = setups[k];
+					m_TriangleVisible[setups[k].id] = SETUP_VISIBLE;
+				}
+				batch.count = 0u;
+			};
+
+			for (std::uint32_t i = begin; i < end; i++)
+			{
+				if (!m_ClusterVisible[i])
+					continue;
+
+				const Cluster& cluster = m_Scene.clusters[i];
+				batch.pTexture = m_Scene.materials[m_Scene.primitives[cluster.mesh].materialIdx].pDiffuse;
+
+				const std::uint32_t firstTriangle = cluster.idxOffset / 3;
+				for (std::uint32_t triangle = firstTriangle; triangle < firstTriangle + cluster.triangleCount; triangle++)
+				{
+					SetupVertex (&vertices)[3] = batch.vertices[batch.count];
+					FetchTriangle(triangle, vertices);
+
+					switch (ClassifyTriangle(vertices))
+					{
+					case TriangleClip::Rejected:
+						break;
+					case TriangleClip::Inside:
+						batch.ids[batch.count++] = triangle;
+						if (batch.count == TriangleBatch::SIZE)
+							flushBatch();
+						break;
+					case TriangleClip::Clipped:
+						m_TriangleVisible[triangle] = SETUP_NEEDS_CLIPPING;
+						clippedCount.fetch_add(1u, std::memory_order_relaxed);
+						break;
+					}
+				}
+				flushBatch();
+			}
+		});
+	}
+
+	// The few triangles needing clipping are handled afterwards, their pieces being appended in a deterministic order
+	if (clippedCount.load(std::memory_order_relaxed) > 0u)
+	{
+#if TRACY_ENABLE
+		ZoneScopedN("Clipping");
+#endif
+		for (size_t i = 0; i < m_Scene.clusters.size(); i++)
+		{
+			if (!m_ClusterVisible[i])
+				continue;
 
-	FILE* pFile = nullptr;
-	fopen_s(&pFile, filename.data(), "wb"); // Use binary mode for writing
-	assert(pFile != nullptr);
+			const Cluster& cluster = m_Scene.clusters[i];
+			Texture* pTexture = m_Scene.materials[m_Scene.primitives[cluster.mesh].materialIdx].pDiffuse;
 
-	// Initialize the PNG writer
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-	assert(png_ptr != nullptr);
+			const std::uint32_t firstTriangle = cluster.idxOffset / 3;
+			for (std::uint32_t triangle = firstTriangle; triangle < firstTriangle + cluster.triangleCount; triangle++)
+			{
+				if (m_TriangleVisible[triangle] != SETUP_NEEDS_CLIPPING)
+					continue;
 
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	assert(info_ptr != nullptr);
+				SetupVertex vertices[3];
+				FetchTriangle(triangle, vertices);
 
-	png_init_io(png_ptr, pFile);
+				SetupVertex polygon[MAX_CLIPPED_VERTICES];
+				const std::uint32_t count = ClipTriangle(vertices, polygon);
+				for (std::uint32_t k = 1; k + 1 < count; k++)
+				{
+					TriangleSetup setup;
+					if (!SetupTriangle(polygon[0], polygon[k], polygon[k + 1], pTexture, setup))
+						continue;
 
-	// Write the PNG header
-	png_set_IHDR(png_ptr, info_ptr, m_ScreenWidth, m_ScreenHeight, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png_ptr, info_ptr);
+					setup.id = static_cast<std::uint32_t>(m_Triangles.size());
+					m_Triangles.push_back(setup);
+					m_TriangleVisible.push_back(SETUP_VISIBLE);
+				}
+			}
+		}
+	}
 
-	// Allocate a row buffer for writing the image data
-	png_bytep row = (png_bytep)malloc(m_ScreenWidth * 3);
+	BinTriangles();
 
-	// Write the image data, row by row
-	for (auto y = 0; y < m_ScreenHeight; ++y)
+	// Raster phase: every tile is owned by a single worker, so its part of the buffers stays in one core's cache
+	std::atomic<std::uint64_t> fragments = 0u;
+	m_Scheduler.ParallelFor(0u, m_TileCountX * m_TileCountY, 1u, [&](std::uint32_t begin, std::uint32_t end)
 	{
+		for (std::uint32_t tile = begin; tile < end; tile++)
+			fragments.fetch_add(RasterizeTile(tile), std::memory_order_relaxed);
+	});
+	m_Stats.depthPassedFragments = fragments.load(std::memory_order_relaxed);
+}
+
+void Rasterizer::BinTriangles()
+{
 #if TRACY_ENABLE
-		ZoneScopedN("Write Row");
+	ZoneScopedN("Binning");
 #endif
-		//#pragma omp parallel for schedule(dynamic)
-		for (auto x = 0; x < m_ScreenWidth; ++x)
+	const std::uint32_t triangleCount = static_cast<std::uint32_t>(m_Triangles.size());
+	const std::uint32_t tileCount = m_TileCountX * m_TileCountY;
+
+	// Count how many triangles overlap each tile
+	m_TileCursors.assign(tileCount, 0u);
+	m_Scheduler.ParallelFor(0u, triangleCount, TRIANGLE_GRAIN, [&](std::uint32_t begin, std::uint32_t end)
+	{
+		for (std::uint32_t i = begin; i < end; i++)
 		{
+			if (m_TriangleVisible[i] != SETUP_VISIBLE)
+				continue;
+
+			const TriangleSetup& setup = m_Triangles[i];
+			for (std::uint32_t ty = setup.minY / TILE_SIZE; ty <= (setup.maxY - 1) / TILE_SIZE; ty++)
+				for (std::uint32_t tx = setup.minX / TILE_SIZE; tx <= (setup.maxX - 1) / TILE_SIZE; tx++)
+					std::atomic_ref<std::uint32_t>(m_TileCursors[ty * m_TileCountX + tx]).fetch_add(1u, std::memory_order_relaxed);
+		}
+	});
+
+	// Prefix sum to get where each tile list starts
+	m_TileOffsets.resize(tileCount + 1);
+	m_TileOffsets[0] = 0u;
+	for (std::uint32_t tile = 0; tile < tileCount; tile++)
+	{
+		m_TileOffsets[tile + 1] = m_TileOffsets[tile] + m_TileCursors[tile];
+		m_TileCursors[tile] = m_TileOffsets[tile];
+	}
+
+	// Scatter triangle indices into the tile lists, the order inside a list is restored by RasterizeTile
+	m_TileTriangles.resize(m_TileOffsets[tileCount]);
+	m_Scheduler.ParallelFor(0u, triangleCount, TRIANGLE_GRAIN, [&](std::uint32_t begin, std::uint32_t end)
+	{
+		for (std::uint32_t i = begin; i < end; i++)
+		{
+			if (m_TriangleVisible[i] != SETUP_VISIBLE)
+				continue;
+
+			const TriangleSetup& setup = m_Triangles[i];
+			for (std::uint32_t ty = setup.minY / TILE_SIZE; ty <= (setup.maxY - 1) / TILE_SIZE; ty++)
+				for (std::uint32_t tx = setup.minX / TILE_SIZE; tx <= (setup.maxX - 1) / TILE_SIZE; tx++)
+				{
+					std::uint32_t slot = std::atomic_ref<std::uint32_t>(m_TileCursors[ty * m_TileCountX + tx]).fetch_add(1u, std::memory_order_relaxed);
+					m_TileTriangles[slot] = i;
+				}
+		}
+	});
+}
+
+std::uint32_t Rasterizer::RasterizeTile(std::uint32_t tile)
+{
 #if TRACY_ENABLE
-			ZoneScopedN("Eval X");
+	ZoneScopedN("Tile");
 #endif
-			// Get the pixel color values, clamped to [0, 255]
-			uint32_t r = static_cast<uint32_t>(255 * glm::clamp(m_FrameBuffer[y * m_ScreenWidth + x].r, 0.0f, 1.0f));
-			uint32_t g = static_cast<uint32_t>(255 * glm::clamp(m_FrameBuffer[y * m_ScreenWidth + x].g, 0.0f, 1.0f));
-			uint32_t b = static_cast<uint32_t>(255 * glm::clamp(m_FrameBuffer[y * m_ScreenWidth + x].b, 0.0f, 1.0f));
-
-			// Write the pixel color values to the row buffer
-			row[x * 3 + 0] = static_cast<png_byte>(r);
-			row[x * 3 + 1] = static_cast<png_byte>(g);
-			row[x * 3 + 2] = static_cast<png_byte>(b);
+	const std::int32_t tileMinX = static_cast<std::int32_t>((tile % m_TileCountX) * TILE_SIZE);
+	const std::int32_t tileMinY = static_cast<std::int32_t>((tile / m_TileCountX) * TILE_SIZE);
+	const std::int32_t tileMaxX = std::min(tileMinX + static_cast<std::int32_t>(TILE_SIZE), static_cast<std::int32_t>(m_ScreenWidth));
+	const std::int32_t tileMaxY = std::min(tileMinY + static_cast<std::int32_t>(TILE_SIZE), static_cast<std::int32_t>(m_ScreenHeight));
+
+	// Binning is done concurrently, sort the list back to submission order so depth ties resolve like in immediate mode
+	auto first = m_TileTriangles.begin() + m_TileOffsets[tile];
+	auto last = m_TileTriangles.begin() + m_TileOffsets[tile + 1];
+	std::sort(first, last);
+
+	std::uint32_t fragments = 0u;
+	for (auto it = first; it != last; ++it)
+	{
+		const TriangleSetup& setup = m_Triangles[*it];
+
+		// The top Hi-Z level matches the tiles: skip triangles behind everything drawn so far in the tile
+		if (setup.minZ > m_HiZ[HIZ_LEVELS - 1][tile])
+		{
+			std::atomic_ref<std::uint64_t>(m_Stats.occludedTriangles).fetch_add(1u, std::memory_order_relaxed);
+			continue;
 		}
 
-		// Write the row buffer to the PNG file
-		png_write_row(png_ptr, row);
+		fragments += RasterizeTriangle(setup,
+			std::max(setup.minX, tileMinX), std::min(setup.maxX, tileMaxX),
+			std::max(setup.minY, tileMinY), std::min(setup.maxY, tileMaxY));
 	}
 
-	// Clean up
-	free(row);
-	png_write_end(png_ptr, nullptr);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(pFile);
+	// Deferred shading of the tile while its visibility buffer is still in cache
+	if (m_ShadingMode == ShadingMode::Visibility)
+	{
+		std::atomic_ref<std::uint64_t>(m_Stats.shadedFragments).fetch_add(
+			ResolveVisibility(tileMinX, tileMaxX, tileMinY, tileMaxY), std::memory_order_relaxed);
+	}
+	return fragments;
+}
+
+void Rasterizer::RenderToPng(const std::string_view filename)
+{
+	[[maybe_unused]] const bool isWritten = RenderToFile(filename, PngWriter());
+	assert(isWritten && "Failed to write the image!");
+}
+
+bool Rasterizer::RenderToFile(std::string_view filename, const ImageWriter& writer)
+{
+	assert(m_FrameBuffer.size() >= (m_ScreenWidth * m_ScreenHeight * GetPixelWords(m_FrameBufferFormat)));
+
+	FrameView frame;
+	frame.width = m_ScreenWidth;
+	frame.height = m_ScreenHeight;
+	frame.format = m_FrameBufferFormat;
+	frame.pPixels = m_FrameBuffer.data();
+	frame.pScheduler = &m_Scheduler;
+	return writer.Write(frame, filename);
 }
@@ -0,0 +1,510 @@
+#include "Rasterizer.hpp"
+
+#include <bit>
+#include <cstddef>
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+#if RASTERIZER_X86
+
+namespace
+{
+	// Vectorized FragmentShader: fetches the texels of 8 fragments with gathers and unpacks them to float lanes.
+	// Only the lanes set in the mask are fetched, the others may hold coordinates far outside of the texture
+	RASTERIZER_AVX2 void SampleTextureAVX2(const Texture& texture, __m256 u, __m256 v, __m256i level, __m256 mask, __m256& r, __m256& g, __m256& b)
+	{
+		// Per-lane mip level description, gathered from the 4 x 32 bit MipLevel records
+		static_assert(sizeof(MipLevel) == 4 * sizeof(std::int32_t));
+		const int* pMips = reinterpret_cast<const int*>(texture.mips.data());
+		level = _mm256_min_epi32(level, _mm256_set1_epi32(static_cast<int>(texture.mips.size()) - 1));
+		const __m256i record = _mm256_slli_epi32(level, 2);
+		const __m256i offset = _mm256_i32gather_epi32(pMips, record, 4);
+		const __m256i width = _mm256_i32gather_epi32(pMips + 1, record, 4);
+		const __m256i height = _mm256_i32gather_epi32(pMips + 2, record, 4);
+		const __m256i tilesX = _mm256_i32gather_epi32(pMips + 3, record, 4);
+
+		// Same wrapping and texel addressing as FragmentShader and MipLevel::TexelIndex
+		const __m256 fracU = _mm256_sub_ps(u, _mm256_round_ps(u, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+		const __m256 fracV = _mm256_sub_ps(v, _mm256_round_ps(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+		const __m256 half = _mm256_set1_ps(0.5f);
+		const __m256i s = _mm256_cvttps_epi32(_mm256_fmsub_ps(fracU, _mm256_cvtepi32_ps(width), half));
+		const __m256i t = _mm256_cvttps_epi32(_mm256_fmsub_ps(fracV, _mm256_cvtepi32_ps(height), half));
+
+		const __m256i tileMask = _mm256_set1_epi32(MipLevel::TILE_SIZE - 1);
+		const __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(t, MipLevel::TILE_SHIFT), tilesX), _mm256_srli_epi32(s, MipLevel::TILE_SHIFT));
+		__m256i index = _mm256_slli_epi32(tile, 2 * MipLevel::TILE_SHIFT);
+		index = _mm256_or_si256(index, _mm256_slli_epi32(_mm256_and_si256(t, tileMask), MipLevel::TILE_SHIFT));
+		index = _mm256_or_si256(index, _mm256_and_si256(s, tileMask));
+		index = _mm256_add_epi32(index, offset);
+
+		const __m256i texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(texture.GetTexels()), index, _mm256_castps_si256(mask), 4);
+
+		// RGBA8 to [0, 1] floats
+		const __m256i byteMask = _mm256_set1_epi32(0xFF);
+		const __m256 scale = _mm256_set1_ps(1.f / 255);
+		r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, byteMask)), scale);
+		g = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), byteMask)), scale);
+		b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), byteMask)), scale);
+	}
+
+	// Exact values of an edge function at 8 consecutive samples of a row. They need 64 bits, so the row is split in a
+	// low (pixels 0-3) and a high (pixels 4-7) half
+	RASTERIZER_AVX2 void EvaluateEdgeAVX2(const EdgeFunction& E, std::int32_t x, std::int32_t y, __m256i& low, __m256i& high)
+	{
+		const std::int64_t e = E.Evaluate(x, y);
+		low = _mm256_setr_epi64x(e, e + E.stepX, e + 2 * E.stepX, e + 3 * E.stepX);
+		high = _mm256_add_epi64(low, _mm256_set1_epi64x(4 * E.stepX));
+	}
+
+	// Vectorized PackColor for the 32 bit formats: clamps, truncates and packs 8 colors with opaque alpha
+	RASTERIZER_AVX2 __m256i PackColorAVX2(FrameBufferFormat format, __m256 r, __m256 g, __m256 b)
+	{
+		const bool isRGBA8 = format == FrameBufferFormat::RGBA8;
+		const __m256 scale = _mm256_set1_ps(isRGBA8 ? 255.0f : 1023.0f);
+		const int shift = isRGBA8 ? 8 : 10;
+		const __m256i alpha = _mm256_set1_epi32(isRGBA8 ? static_cast<int>(0xFF000000u) : static_cast<int>(0xC0000000u));
+
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256i ri = _mm256_cvttps_epi32(_mm256_mul_ps(scale, _mm256_min_ps(_mm256_max_ps(r, zero), one)));
+		const __m256i gi = _mm256_cvttps_epi32(_mm256_mul_ps(scale, _mm256_min_ps(_mm256_max_ps(g, zero), one)));
+		const __m256i bi = _mm256_cvttps_epi32(_mm256_mul_ps(scale, _mm256_min_ps(_mm256_max_ps(b, zero), one)));
+		const __m256i gb = _mm256_or_si256(gi, _mm256_sll_epi32(bi, _mm_cvtsi32_si128(shift)));
+		return _mm256_or_si256(_mm256_or_si256(ri, alpha), _mm256_sll_epi32(gb, _mm_cvtsi32_si128(shift)));
+	}
+
+	// One component of a corner of every triangle of a batch, offset being the index of the component in a
+	// SetupVertex, in floats. laneOffsets holds the offset of the vertices of each lane, in floats too
+	RASTERIZER_AVX2 __m256 GatherVertexAVX2(const TriangleBatch& batch, __m256i laneOffsets, std::uint32_t corner, std::size_t offset)
+	{
+		const float* pBase = reinterpret_cast<const float*>(&batch.vertices[0][corner]) + offset;
+		return _mm256_i32gather_ps(pBase, laneOffsets, 4);
+	}
+
+	// Same as SetupTriangle's std::llround on the projected coordinates: scaling by a power of two is exact, and ties
+	// are rounded away from zero. value - truncated is exact as well, so is the comparison of the fraction with 0.5
+	RASTERIZER_AVX2 __m256i SnapAVX2(__m256 projected)
+	{
+		const __m256 value = _mm256_mul_ps(projected, _mm256_set1_ps(static_cast<float>(1 << Rasterizer::SUBPIXEL_BITS)));
+		const __m256 truncated = _mm256_round_ps(value, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		const __m256 signMask = _mm256_set1_ps(-0.0f);
+		const __m256 fraction = _mm256_andnot_ps(signMask, _mm256_sub_ps(value, truncated));
+		const __m256 awayFromZero = _mm256_or_ps(_mm256_and_ps(value, signMask), _mm256_set1_ps(1.0f));
+		const __m256 roundsAway = _mm256_cmp_ps(fraction, _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+		return _mm256_cvttps_epi32(_mm256_add_ps(truncated, _mm256_and_ps(roundsAway, awayFromZero)));
+	}
+
+	// Sign of the snapped area of 4 triangles, one bit per front-facing one. Snapped coordinates are under 2^25,
+	// so the products and their difference are exact in double precision
+	RASTERIZER_AVX2 int FrontFacingMaskAVX2(__m128i dX1, __m128i dY2, __m128i dX2, __m128i dY1)
+	{
+		const __m256d area = _mm256_sub_pd(
+			_mm256_mul_pd(_mm256_cvtepi32_pd(dX1), _mm256_cvtepi32_pd(dY2)),
+			_mm256_mul_pd(_mm256_cvtepi32_pd(dX2), _mm256_cvtepi32_pd(dY1)));
+		return _mm256_movemask_pd(_mm256_cmp_pd(area, _mm256_setzero_pd(), _CMP_LT_OQ));
+	}
+}
+
+// 8-wide version of RasterizeBlockScalar, processing 8 consecutive pixels of a row per step
+template<bool TestCoverage>
+RASTERIZER_AVX2 std::uint32_t Rasterizer::RasterizeBlockAVX2(const TriangleSetup& setup, std::int32_t minX, std::int32_t maxX, std::int32_t minY, std::int32_t maxY)
+{
+	std::uint32_t fragments = 0u;
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	// Edge functions only need their x step, they are evaluated once per row then incremented
+	const __m256i e0Step = _mm256_set1_epi64x(setup.E0.stepX * 8);
+	const __m256i e1Step = _mm256_set1_epi64x(setup.E1.stepX * 8);
+	const __m256i e2Step = _mm256_set1_epi64x(setup.E2.stepX * 8);
+	const __m256i zero64 = _mm256_setzero_si256();
+	// Even 32 bit halves of the 64 bit masks, low half to lanes 0-3 and high half to lanes 4-7
+	const __m256i packMask = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+	alignas(32) float red[8], green[8], blue[8];
+
+	// Attributes of the 8 first samples of the block, then stepped by dy every row and by 8 dx along a row.
+	// FragmentShader does not use the normals, only 1/w, z and UV are needed
+	const AttributeGradients& gradients = setup.gradients;
+	const __m256 laneSteps = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	__m256 rowOneOverW = _mm256_fmadd_ps(_mm256_set1_ps(gradients.dx[ATTRIBUTE_ONE_OVER_W]), laneSteps, _mm256_set1_ps(gradients.Evaluate(ATTRIBUTE_ONE_OVER_W, minX, minY)));
+	__m256 rowZOverW = _mm256_fmadd_ps(_mm256_set1_ps(gradients.dx[ATTRIBUTE_Z]), laneSteps, _mm256_set1_ps(gradients.Evaluate(ATTRIBUTE_Z, minX, minY)));
+	__m256 rowUOverW = _mm256_fmadd_ps(_mm256_set1_ps(gradients.dx[ATTRIBUTE_U]), laneSteps, _mm256_set1_ps(gradients.Evaluate(ATTRIBUTE_U, minX, minY)));
+	__m256 rowVOverW = _mm256_fmadd_ps(_mm256_set1_ps(gradients.dx[ATTRIBUTE_V]), laneSteps, _mm256_set1_ps(gradients.Evaluate(ATTRIBUTE_V, minX, minY)));
+	const __m256 oneOverWStep = _mm256_set1_ps(gradients.dx[ATTRIBUTE_ONE_OVER_W] * 8.0f);
+	const __m256 zOverWStep = _mm256_set1_ps(gradients.dx[ATTRIBUTE_Z] * 8.0f);
+	const __m256 uOverWStep = _mm256_set1_ps(gradients.dx[ATTRIBUTE_U] * 8.0f);
+	const __m256 vOverWStep = _mm256_set1_ps(gradients.dx[ATTRIBUTE_V] * 8.0f);
+
+	// Derivatives for the mip level selection
+	const __m256 oneOverWdx = _mm256_set1_ps(gradients.dx[ATTRIBUTE_ONE_OVER_W]);
+	const __m256 oneOverWdy = _mm256_set1_ps(gradients.dy[ATTRIBUTE_ONE_OVER_W]);
+	const __m256 uOverWdx = _mm256_set1_ps(gradients.dx[ATTRIBUTE_U]);
+	const __m256 uOverWdy = _mm256_set1_ps(gradients.dy[ATTRIBUTE_U]);
+	const __m256 vOverWdx = _mm256_set1_ps(gradients.dx[ATTRIBUTE_V]);
+	const __m256 vOverWdy = _mm256_set1_ps(gradients.dy[ATTRIBUTE_V]);
+
+	// Texture size of level 0 for the mip level selection
+	const __m256 texWidth = _mm256_set1_ps(static_cast<float>(setup.pTexture->width));
+	const __m256 texHeight = _mm256_set1_ps(static_cast<float>(setup.pTexture->height));
+
+	for (auto y = minY; y < maxY; y++)
+	{
+#if TRACY_ENABLE
+		ZoneScopedN("EdgeEval AVX2");
+#endif
+		__m256 oneOverW = rowOneOverW;
+		__m256 zOverW = rowZOverW;
+		__m256 uOverW = rowUOverW;
+		__m256 vOverW = rowVOverW;
+
+		// Evaluate the edges at the 8 first samples of the row
+		__m256i Ei1Low, Ei1High, Ei2Low, Ei2High, Ei3Low, Ei3High;
+		EvaluateEdgeAVX2(setup.E0, minX, y, Ei1Low, Ei1High);
+		EvaluateEdgeAVX2(setup.E1, minX, y, Ei2Low, Ei2High);
+		EvaluateEdgeAVX2(setup.E2, minX, y, Ei3Low, Ei3High);
+
+		for (auto x = minX; x < maxX; x += 8)
+		{
+			// Lanes past the end of the region are masked out
+			const __m256i inRegion = _mm256_cmpgt_epi32(_mm256_set1_epi32(maxX - x), laneIndices);
+
+			// If sample is "inside" of all three half-spaces bounded by the three edges of the triangle, it's 'on' the triangle
+			// (always the case in blocks classified as inside)
+			__m256 covered = _mm256_castsi256_ps(inRegion);
+			if constexpr (TestCoverage)
+			{
+				const __m256i insideLow = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi64(Ei1Low, zero64), _mm256_cmpgt_epi64(Ei2Low, zero64)), _mm256_cmpgt_epi64(Ei3Low, zero64));
+				const __m256i insideHigh = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi64(Ei1High, zero64), _mm256_cmpgt_epi64(Ei2High, zero64)), _mm256_cmpgt_epi64(Ei3High, zero64));
+				const __m256i inside = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(insideLow, packMask), _mm256_permutevar8x32_epi32(insideHigh, packMask), 0xF0);
+				covered = _mm256_and_ps(covered, _mm256_castsi256_ps(inside));
+			}
+
+			if (_mm256_movemask_ps(covered) != 0)
+			{
+				// Perspective divide of the covered fragments, then do the depth test on all of them at once
+				const __m256 wv = _mm256_div_ps(_mm256_set1_ps(1.0f), oneOverW);
+				const __m256 z = _mm256_mul_ps(zOverW, wv);
+
+				const int index = x + y * m_ScreenWidth;
+				float* pDepth = m_DepthBuffer.data() + index;
+				const __m256 depth = _mm256_maskload_ps(pDepth, _mm256_castps_si256(covered));
+				const __m256 passed = _mm256_and_ps(covered, _mm256_cmp_ps(z, depth, _CMP_LE_OQ));
+
+				int passMask = _mm256_movemask_ps(passed);
+				if (passMask != 0)
+				{
+					// Depth test passed; update depth buffer values
+					_mm256_maskstore_ps(pDepth, _mm256_castps_si256(passed), z);
+					fragments += std::popcount(static_cast<unsigned>(passMask));
+
+					if (m_ShadingMode == ShadingMode::Visibility)
+					{
+						// Only remember which triangle is visible, it gets shaded once in ResolveVisibility
+						_mm256_maskstore_epi32(reinterpret_cast<int*>(m_VisibilityBuffer.data() + index), _mm256_castps_si256(passed), _mm256_set1_epi32(static_cast<int>(setup.id)));
+					}
+					else
+					{
+						// Texture coordinates (FragmentShader does not use the normals)
+						const __m256 uv = _mm256_mul_ps(uOverW, wv);
+						const __m256 vv = _mm256_mul_ps(vOverW, wv);
+
+						// Same mip level selection as ComputeMipLevel, for the 8 lanes at once
+						const __m256 wu = _mm256_mul_ps(wv, texWidth);
+						const __m256 wt = _mm256_mul_ps(wv, texHeight);
+						const __m256 dudx = _mm256_mul_ps(wu, _mm256_fnmadd_ps(uv, oneOverWdx, uOverWdx));
+						const __m256 dvdx = _mm256_mul_ps(wt, _mm256_fnmadd_ps(vv, oneOverWdx, vOverWdx));
+						const __m256 dudy = _mm256_mul_ps(wu, _mm256_fnmadd_ps(uv, oneOverWdy, uOverWdy));
+						const __m256 dvdy = _mm256_mul_ps(wt, _mm256_fnmadd_ps(vv, oneOverWdy, vOverWdy));
+						const __m256 rho2 = _mm256_max_ps(_mm256_max_ps(
+							_mm256_fmadd_ps(dudx, dudx, _mm256_mul_ps(dvdx, dvdx)),
+							_mm256_fmadd_ps(dudy, dudy, _mm256_mul_ps(dvdy, dvdy))), _mm256_set1_ps(1.0f));
+						// (exponent + 1) / 2 with exponent = (bits >> 23) - 127
+						const __m256i level = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_srli_epi32(_mm256_castps_si256(rho2), 23), _mm256_set1_epi32(126)), 1);
+
+						// Shade the 8 lanes at once, then scatter the colors of the ones that passed
+						__m256 r, g, b;
+						SampleTextureAVX2(*setup.pTexture, uv, vv, level, passed, r, g, b);
+
+						if (m_FrameBufferFormat == FrameBufferFormat::RGBA16F)
+						{
+							_mm256_store_ps(red, r);
+							_mm256_store_ps(green, g);
+							_mm256_store_ps(blue, b);
+							while (passMask != 0)
+							{
+								const int lane = std::countr_zero(static_cast<unsigned>(passMask));
+								passMask &= passMask - 1;
+								WriteColor(index + lane, glm::vec3(red[lane], green[lane], blue[lane]));
+							}
+						}
+						else
+						{
+							// Same quantization as PackColor, storing the 8 pixels at once
+							_mm256_maskstore_epi32(reinterpret_cast<int*>(m_FrameBuffer.data() + index), _mm256_castps_si256(passed), PackColorAVX2(m_FrameBufferFormat, r, g, b));
+						}
+					}
+				}
+			}
+
+			//Increment Egde position for the next 8 samples of the row
+			Ei1Low = _mm256_add_epi64(Ei1Low, e0Step);
+			Ei1High = _mm256_add_epi64(Ei1High, e0Step);
+			Ei2Low = _mm256_add_epi64(Ei2Low, e1Step);
+			Ei2High = _mm256_add_epi64(Ei2High, e1Step);
+			Ei3Low = _mm256_add_epi64(Ei3Low, e2Step);
+			Ei3High = _mm256_add_epi64(Ei3High, e2Step);
+			oneOverW = _mm256_add_ps(oneOverW, oneOverWStep);
+			zOverW = _mm256_add_ps(zOverW, zOverWStep);
+			uOverW = _mm256_add_ps(uOverW, uOverWStep);
+			vOverW = _mm256_add_ps(vOverW, vOverWStep);
+		}
+
+		rowOneOverW = _mm256_add_ps(rowOneOverW, oneOverWdy);
+		rowZOverW = _mm256_add_ps(rowZOverW, _mm256_set1_ps(gradients.dy[ATTRIBUTE_Z]));
+		rowUOverW = _mm256_add_ps(rowUOverW, uOverWdy);
+		rowVOverW = _mm256_add_ps(rowVOverW, vOverWdy);
+	}
+	return fragments;
+}
+
+template std::uint32_t Rasterizer::RasterizeBlockAVX2<true>(const TriangleSetup&, std::int32_t, std::int32_t, std::int32_t, std::int32_t);
+template std::uint32_t Rasterizer::RasterizeBlockAVX2<false>(const TriangleSetup&, std::int32_t, std::int32_t, std::int32_t, std::int32_t);
+
+RASTERIZER_AVX2 std::uint32_t Rasterizer::SetupTriangleBatchAVX2(const TriangleBatch& batch, TriangleSetup* pSetups)
+{
+	static_assert(TriangleBatch::SIZE == 8u && sizeof(SetupVertex) % sizeof(float) == 0);
+	constexpr std::int32_t vertexFloats = sizeof(SetupVertex) / sizeof(float);
+	constexpr std::size_t position = offsetof(SetupVertex, pos) / sizeof(float);
+	constexpr std::size_t normal = offsetof(SetupVertex, normal) / sizeof(float);
+	constexpr std::size_t texCoords = offsetof(SetupVertex, texCoords) / sizeof(float);
+
+	// Lanes past the end of the batch read the first triangle again, they are dropped with the culled ones
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i inBatch = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(batch.count)), laneIndices);
+	const __m256i laneOffsets = _mm256_and_si256(inBatch, _mm256_mullo_epi32(laneIndices, _mm256_set1_epi32(3 * vertexFloats)));
+
+	// Homogeneous raster positions of the three corners, and their projection snapped exactly like in SetupTriangle
+	__m256 x[3], y[3], z[3], w[3], oneOverW[3];
+	__m256i X[3], Y[3];
+	for (std::uint32_t i = 0; i < 3; i++)
+	{
+		x[i] = GatherVertexAVX2(batch, laneOffsets, i, position);
+		y[i] = GatherVertexAVX2(batch, laneOffsets, i, position + 1);
+		z[i] = GatherVertexAVX2(batch, laneOffsets, i, position + 2);
+		w[i] = GatherVertexAVX2(batch, laneOffsets, i, position + 3);
+
+		oneOverW[i] = _mm256_div_ps(_mm256_set1_ps(1.0f), w[i]);
+		X[i] = SnapAVX2(_mm256_mul_ps(x[i], oneOverW[i]));
+		Y[i] = SnapAVX2(_mm256_mul_ps(y[i], oneOverW[i]));
+	}
+
+	// Back-facing and degenerate triangles, from the sign of the snapped area
+	const __m256i dX1 = _mm256_sub_epi32(X[1], X[0]);
+	const __m256i dY2 = _mm256_sub_epi32(Y[2], Y[0]);
+	const __m256i dX2 = _mm256_sub_epi32(X[2], X[0]);
+	const __m256i dY1 = _mm256_sub_epi32(Y[1], Y[0]);
+	const int frontFacing = FrontFacingMaskAVX2(_mm256_castsi256_si128(dX1), _mm256_castsi256_si128(dY2), _mm256_castsi256_si128(dX2), _mm256_castsi256_si128(dY1)) |
+		(FrontFacingMaskAVX2(_mm256_extracti128_si256(dX1, 1), _mm256_extracti128_si256(dY2, 1), _mm256_extracti128_si256(dX2, 1), _mm256_extracti128_si256(dY1, 1)) << 4);
+
+	// Bounding boxes of the pixels whose center may be covered, triangles covering no pixel center are dropped
+	const __m256i halfPixel = _mm256_set1_epi32(1 << (SUBPIXEL_BITS - 1));
+	const __m256i lastSubpixel = _mm256_set1_epi32((1 << SUBPIXEL_BITS) - 1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i width = _mm256_set1_epi32(static_cast<int>(m_ScreenWidth));
+	const __m256i height = _mm256_set1_epi32(static_cast<int>(m_ScreenHeight));
+	const __m256i minXs = _mm256_min_epi32(X[0], _mm256_min_epi32(X[1], X[2]));
+	const __m256i maxXs = _mm256_max_epi32(X[0], _mm256_max_epi32(X[1], X[2]));
+	const __m256i minYs = _mm256_min_epi32(Y[0], _mm256_min_epi32(Y[1], Y[2]));
+	const __m256i maxYs = _mm256_max_epi32(Y[0], _mm256_max_epi32(Y[1], Y[2]));
+	const __m256i minX = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(minXs, halfPixel), lastSubpixel), SUBPIXEL_BITS), zero), width);
+	const __m256i maxX = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(_mm256_srai_epi32(_mm256_sub_epi32(maxXs, halfPixel), SUBPIXEL_BITS), one), zero), width);
+	const __m256i minY = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(minYs, halfPixel), lastSubpixel), SUBPIXEL_BITS), zero), height);
+	const __m256i maxY = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(_mm256_srai_epi32(_mm256_sub_epi32(maxYs, halfPixel), SUBPIXEL_BITS), one), zero), height);
+	const __m256i covers = _mm256_and_si256(inBatch, _mm256_and_si256(_mm256_cmpgt_epi32(maxX, minX), _mm256_cmpgt_epi32(maxY, minY)));
+
+	const unsigned visible = static_cast<unsigned>(frontFacing & _mm256_movemask_ps(_mm256_castsi256_ps(covers)));
+	if (visible == 0u)
+		return 0u;
+
+	// Triangles whose box fits in SMALL_TRIANGLE_SIZE pixels get their gradients from the edge functions, as in
+	// SetupTriangle. Their edge values are computed in 32 bits, which is exact as long as the vertices are less than
+	// SMALL_VERTEX_SPAN apart. Small boxes cut by the screen border may come from farther apart vertices: those few
+	// triangles go through SetupTriangle
+	const __m256i smallSize = _mm256_set1_epi32(SMALL_TRIANGLE_SIZE + 1);
+	const __m256i smallBox = _mm256_and_si256(_mm256_cmpgt_epi32(smallSize, _mm256_sub_epi32(maxX, minX)), _mm256_cmpgt_epi32(smallSize, _mm256_sub_epi32(maxY, minY)));
+	const __m256i span = _mm256_set1_epi32(SMALL_VERTEX_SPAN << SUBPIXEL_BITS);
+	const __m256i closeVertices = _mm256_and_si256(_mm256_cmpgt_epi32(span, _mm256_sub_epi32(maxXs, minXs)), _mm256_cmpgt_epi32(span, _mm256_sub_epi32(maxYs, minYs)));
+	const __m256 smallLanes = _mm256_castsi256_ps(_mm256_and_si256(smallBox, closeVertices));
+	const unsigned fallback = visible & static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(closeVertices, smallBox))));
+	const bool anySmall = (visible & static_cast<unsigned>(_mm256_movemask_ps(smallLanes))) != 0u;
+	const bool anyLarge = (visible & ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(smallBox)))) != 0u;
+
+	// Edge values at the center of the first pixel of the box, the same integers as the EdgeFunction ones, and the
+	// barycentric weights they give: value, x and y steps. Edge i goes from vertex j to vertex k
+	__m256 weights[3][3];
+	if (anySmall)
+	{
+		const __m256i halfPixel32 = _mm256_set1_epi32(1 << (SUBPIXEL_BITS - 1));
+		const __m256i centerX = _mm256_add_epi32(_mm256_slli_epi32(minX, SUBPIXEL_BITS), halfPixel32);
+		const __m256i centerY = _mm256_add_epi32(_mm256_slli_epi32(minY, SUBPIXEL_BITS), halfPixel32);
+		__m256i e[3], a[3], b[3];
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			const std::uint32_t j = (i + 1) % 3;
+			const std::uint32_t k = (i + 2) % 3;
+			a[i] = _mm256_sub_epi32(Y[k], Y[j]);
+			b[i] = _mm256_sub_epi32(X[j], X[k]);
+
+			// Top-left fill rule bias, see MakeEdgeFunction
+			const __m256i isTopLeft = _mm256_or_si256(_mm256_cmpgt_epi32(a[i], zero), _mm256_and_si256(_mm256_cmpeq_epi32(a[i], zero), _mm256_cmpgt_epi32(b[i], zero)));
+			e[i] = _mm256_add_epi32(_mm256_mullo_epi32(a[i], _mm256_sub_epi32(centerX, X[j])), _mm256_mullo_epi32(b[i], _mm256_sub_epi32(centerY, Y[j])));
+			e[i] = _mm256_sub_epi32(e[i], isTopLeft);
+		}
+
+		const __m256 oneOverArea = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(e[0], e[1]), e[2])));
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			weights[i][0] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(a[i], SUBPIXEL_BITS)), oneOverArea);
+			weights[i][1] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(b[i], SUBPIXEL_BITS)), oneOverArea);
+			weights[i][2] = _mm256_mul_ps(_mm256_cvtepi32_ps(e[i]), oneOverArea);
+		}
+	}
+
+	// Inverse of the vertex matrix of the other lanes, its rows being (x, y, w) of each corner relative to the center of
+	// the first pixel of the box as in SetupTriangle: column i of the inverse is the cross product of the two other
+	// rows divided by the determinant
+	const __m256 boxX = _mm256_cvtepi32_ps(minX);
+	const __m256 boxY = _mm256_cvtepi32_ps(minY);
+	__m256 inverse[3][3];
+	if (anyLarge)
+	{
+		const __m256 originX = _mm256_add_ps(boxX, _mm256_set1_ps(0.5f));
+		const __m256 originY = _mm256_add_ps(boxY, _mm256_set1_ps(0.5f));
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			x[i] = _mm256_sub_ps(x[i], _mm256_mul_ps(originX, w[i]));
+			y[i] = _mm256_sub_ps(y[i], _mm256_mul_ps(originY, w[i]));
+		}
+
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			const std::uint32_t j = (i + 1) % 3;
+			const std::uint32_t k = (i + 2) % 3;
+			inverse[i][0] = _mm256_sub_ps(_mm256_mul_ps(y[j], w[k]), _mm256_mul_ps(w[j], y[k]));
+			inverse[i][1] = _mm256_sub_ps(_mm256_mul_ps(w[j], x[k]), _mm256_mul_ps(x[j], w[k]));
+			inverse[i][2] = _mm256_sub_ps(_mm256_mul_ps(x[j], y[k]), _mm256_mul_ps(y[j], x[k]));
+		}
+		const __m256 det = _mm256_fmadd_ps(x[0], inverse[0][0], _mm256_fmadd_ps(y[0], inverse[0][1], _mm256_mul_ps(w[0], inverse[0][2])));
+		const __m256 oneOverDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+		for (auto& column : inverse)
+			for (__m256& value : column)
+				value = _mm256_mul_ps(value, oneOverDet);
+	}
+
+	// Gradient record of each attribute, from the interpolation vector (a, b, c) or from the barycentric weights,
+	// transposed to one array per lane
+	alignas(32) float starts[ATTRIBUTE_COUNT][8], dxs[ATTRIBUTE_COUNT][8], dys[ATTRIBUTE_COUNT][8];
+	for (std::uint32_t attribute = 0; attribute < ATTRIBUTE_COUNT; attribute++)
+	{
+		__m256 values[3];
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			switch (attribute)
+			{
+			case ATTRIBUTE_ONE_OVER_W: values[i] = _mm256_set1_ps(1.0f); break;
+			case ATTRIBUTE_Z: values[i] = z[i]; break;
+			case ATTRIBUTE_NX: values[i] = GatherVertexAVX2(batch, laneOffsets, i, normal); break;
+			case ATTRIBUTE_NY: values[i] = GatherVertexAVX2(batch, laneOffsets, i, normal + 1); break;
+			case ATTRIBUTE_NZ: values[i] = GatherVertexAVX2(batch, laneOffsets, i, normal + 2); break;
+			case ATTRIBUTE_U: values[i] = GatherVertexAVX2(batch, laneOffsets, i, texCoords); break;
+			default: values[i] = GatherVertexAVX2(batch, laneOffsets, i, texCoords + 1); break;
+			}
+		}
+
+		__m256 dx = _mm256_setzero_ps();
+		__m256 dy = _mm256_setzero_ps();
+		__m256 start = _mm256_setzero_ps();
+		if (anyLarge)
+		{
+			__m256 plane[3];
+			for (std::uint32_t c = 0; c < 3; c++)
+				plane[c] = _mm256_fmadd_ps(values[2], inverse[2][c], _mm256_fmadd_ps(values[1], inverse[1][c], _mm256_mul_ps(values[0], inverse[0][c])));
+			dx = plane[0];
+			dy = plane[1];
+			start = _mm256_sub_ps(_mm256_sub_ps(plane[2], _mm256_mul_ps(plane[0], boxX)), _mm256_mul_ps(plane[1], boxY));
+		}
+		if (anySmall)
+		{
+			// Attribute over w at the vertices, weighted and summed in the same order as SetupTriangle
+			__m256 combined[3];
+			for (std::uint32_t c = 0; c < 3; c++)
+			{
+				combined[c] = _mm256_mul_ps(weights[0][c], _mm256_mul_ps(values[0], oneOverW[0]));
+				combined[c] = _mm256_add_ps(combined[c], _mm256_mul_ps(weights[1][c], _mm256_mul_ps(values[1], oneOverW[1])));
+				combined[c] = _mm256_add_ps(combined[c], _mm256_mul_ps(weights[2][c], _mm256_mul_ps(values[2], oneOverW[2])));
+			}
+			const __m256 smallStart = _mm256_sub_ps(_mm256_sub_ps(combined[2], _mm256_mul_ps(combined[0], boxX)), _mm256_mul_ps(combined[1], boxY));
+			dx = _mm256_blendv_ps(dx, combined[0], smallLanes);
+			dy = _mm256_blendv_ps(dy, combined[1], smallLanes);
+			start = _mm256_blendv_ps(start, smallStart, smallLanes);
+		}
+
+		_mm256_store_ps(dxs[attribute], dx);
+		_mm256_store_ps(dys[attribute], dy);
+		_mm256_store_ps(starts[attribute], start);
+	}
+
+	alignas(32) std::int32_t snappedX[3][8], snappedY[3][8];
+	for (std::uint32_t i = 0; i < 3; i++)
+	{
+		_mm256_store_si256(reinterpret_cast<__m256i*>(snappedX[i]), X[i]);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(snappedY[i]), Y[i]);
+	}
+	alignas(32) std::int32_t boxes[4][8];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(boxes[0]), minX);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(boxes[1]), maxX);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(boxes[2]), minY);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(boxes[3]), maxY);
+	alignas(32) float minZ[8], maxZ[8];
+	_mm256_store_ps(minZ, _mm256_min_ps(z[0], _mm256_min_ps(z[1], z[2])));
+	_mm256_store_ps(maxZ, _mm256_max_ps(z[0], _mm256_max_ps(z[1], z[2])));
+
+	// Compact the surviving lanes into the setup buffer, in batch order. Edge functions need 64 bit products
+	std::uint32_t count = 0u;
+	for (unsigned remaining = visible; remaining != 0u; remaining &= remaining - 1)
+	{
+		const int lane = std::countr_zero(remaining);
+		if ((fallback >> lane) & 1u)
+		{
+			const SetupVertex (&vertices)[3] = batch.vertices[lane];
+			if (SetupTriangle(vertices[0], vertices[1], vertices[2], batch.pTexture, pSetups[count]))
+				pSetups[count++].id = batch.ids[lane];
+			continue;
+		}
+
+		TriangleSetup& setup = pSetups[count++];
+		for (std::uint32_t attribute = 0; attribute < ATTRIBUTE_COUNT; attribute++)
+		{
+			setup.gradients.start[attribute] = starts[attribute][lane];
+			setup.gradients.dx[attribute] = dxs[attribute][lane];
+			setup.gradients.dy[attribute] = dys[attribute][lane];
+		}
+		setup.E0 = MakeEdgeFunction(snappedX[1][lane], snappedY[1][lane], snappedX[2][lane], snappedY[2][lane]);
+		setup.E1 = MakeEdgeFunction(snappedX[2][lane], snappedY[2][lane], snappedX[0][lane], snappedY[0][lane]);
+		setup.E2 = MakeEdgeFunction(snappedX[0][lane], snappedY[0][lane], snappedX[1][lane], snappedY[1][lane]);
+		setup.minZ = minZ[lane];
+		setup.maxZ = maxZ[lane];
+		setup.minX = boxes[0][lane];
+		setup.maxX = boxes[1][lane];
+		setup.minY = boxes[2][lane];
+		setup.maxY = boxes[3][lane];
+		setup.pTexture = batch.pTexture;
+		setup.id = batch.ids[lane];
+	}
+	return count;
+}
+
+#endif // RASTERIZER_X86
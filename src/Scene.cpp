@@ -1,5 +1,102 @@
 #include "Scene.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+namespace
+{
+	// Packs a texel of the source image as RGBA8, grey levels being replicated and missing alpha being opaque
+	std::uint32_t PackTexel(const stbi_uc* pTexel, std::int32_t numChannels)
+	{
+		std::uint32_t r, g, b, a = 255u;
+		switch (numChannels)
+		{
+		case 1:
+			r = g = b = pTexel[0];
+			break;
+		case 2:
+			r = g = b = pTexel[0];
+			a = pTexel[1];
+			break;
+		default:
+			r = pTexel[0];
+			g = pTexel[1];
+			b = pTexel[2];
+			if (numChannels == 4)
+				a = pTexel[3];
+			break;
+		}
+		return r | (g << 8) | (b << 16) | (a << 24);
+	}
+}
+
+void Texture::GenerateMipChain()
+{
+	// Size of every level first, so that the storage is allocated once
+	mips.clear();
+	std::uint32_t tileCount = 0;
+	for (std::int32_t levelWidth = width, levelHeight = height;; levelWidth = std::max(levelWidth / 2, 1), levelHeight = std::max(levelHeight / 2, 1))
+	{
+		MipLevel mip;
+		mip.offset = tileCount * (MipLevel::TILE_SIZE * MipLevel::TILE_SIZE);
+		mip.width = levelWidth;
+		mip.height = levelHeight;
+		mip.tilesX = (levelWidth + MipLevel::TILE_SIZE - 1) >> MipLevel::TILE_SHIFT;
+		tileCount += mip.tilesX * ((levelHeight + MipLevel::TILE_SIZE - 1) >> MipLevel::TILE_SHIFT);
+		mips.push_back(mip);
+
+		if (levelWidth == 1 && levelHeight == 1)
+			break;
+	}
+	tiles.assign(tileCount, TexelTile{});
+
+	std::uint32_t* pTexels = tiles.front().texels;
+	for (size_t level = 0; level < mips.size(); level++)
+	{
+		const MipLevel& mip = mips[level];
+		for (std::int32_t y = 0; y < mip.height; y++)
+		{
+			for (std::int32_t x = 0; x < mip.width; x++)
+			{
+				if (level == 0)
+				{
+					// Tiled RGBA8 copy of the row-major source image
+					pTexels[mip.TexelIndex(x, y)] = PackTexel(data + (y * width + x) * numChannels, numChannels);
+					continue;
+				}
+
+				// Average of the 2x2 parent texels, clamped on odd sizes, all four channels at once
+				const MipLevel& parent = mips[level - 1];
+				const std::int32_t x0 = std::min(x * 2, parent.width - 1);
+				const std::int32_t x1 = std::min(x * 2 + 1, parent.width - 1);
+				const std::int32_t y0 = std::min(y * 2, parent.height - 1);
+				const std::int32_t y1 = std::min(y * 2 + 1, parent.height - 1);
+				const std::uint32_t t00 = pTexels[parent.TexelIndex(x0, y0)];
+				const std::uint32_t t10 = pTexels[parent.TexelIndex(x1, y0)];
+				const std::uint32_t t01 = pTexels[parent.TexelIndex(x0, y1)];
+				const std::uint32_t t11 = pTexels[parent.TexelIndex(x1, y1)];
+
+				std::uint32_t texel = 0u;
+				for (std::uint32_t shift = 0; shift < 32; shift += 8)
+				{
+					const std::uint32_t sum = ((t00 >> shift) & 0xFFu) + ((t10 >> shift) & 0xFFu) + ((t01 >> shift) & 0xFFu) + ((t11 >> shift) & 0xFFu);
+					texel |= ((sum + 2) / 4) << shift;
+				}
+				pTexels[mip.TexelIndex(x, y)] = texel;
+			}
+		}
+	}
+}
+
 Scene::Scene()
 {
 	m_Camera = Camera();
@@ -17,149 +114,704 @@ Scene::Scene(Scene&& other) noexcept
 	vertexBuffer = std::move(other.vertexBuffer);
 	indexBuffer = std::move(other.indexBuffer);
 	primitives = std::move(other.primitives);
+	materials = std::move(other.materials);
 	textures = std::move(other.textures);
+	clusters = std::move(other.clusters);
+	bvh = std::move(other.bvh);
+	m_MappedFiles = std::move(other.m_MappedFiles);
+	m_TextureQueue = std::move(other.m_TextureQueue);
+	m_TextureWorkers = std::move(other.m_TextureWorkers);
+	m_DecodeCancelled = std::exchange(other.m_DecodeCancelled, std::make_shared<std::atomic<bool>>(false));
 }
 
 Scene::~Scene()
 {
-	// Clean up resources
+	// Clean up resources, once no worker writes to them. Textures not started are simply dropped: the queued ones are
+	// never handed out, and the workers stop before their next one
+	m_TextureQueue.clear();
+	m_DecodeCancelled->store(true);
+	WaitForTextures();
 	for (const auto& elem : textures)
+	{
+		stbi_image_free(elem.second->data);
 		delete elem.second;
+	}
 }
 
 Scene& Scene::operator=(Scene&& other) noexcept
 {
-	// Clean up resources
+	// Clean up resources, once no worker writes to them. Textures not started are simply dropped: the queued ones are
+	// never handed out, and the workers stop before their next one
+	m_TextureQueue.clear();
+	m_DecodeCancelled->store(true);
+	WaitForTextures();
 	for (const auto& elem : textures)
+	{
+		stbi_image_free(elem.second->data);
 		delete elem.second;
+	}
 
 	m_Camera = std::move(other.m_Camera);
 
 	vertexBuffer = std::move(other.vertexBuffer);
 	indexBuffer = std::move(other.indexBuffer);
 	primitives = std::move(other.primitives);
+	materials = std::move(other.materials);
 	textures = std::move(other.textures);
+	clusters = std::move(other.clusters);
+	bvh = std::move(other.bvh);
+	m_MappedFiles = std::move(other.m_MappedFiles);
+	m_TextureQueue = std::move(other.m_TextureQueue);
+	m_TextureWorkers = std::move(other.m_TextureWorkers);
+	m_DecodeCancelled = std::exchange(other.m_DecodeCancelled, std::make_shared<std::atomic<bool>>(false));
 	return *this;
 }
 
+namespace
+{
+	// Vertices and indices of a single shape, indices being relative to the shape vertices
+	struct ShapeImport
+	{
+		std::vector<VertexInput> vertices;
+		std::vector<std::uint32_t> indices;
+	};
+
+	// Open addressing hash table (linear probing) from OBJ index triplets to vertex indices
+	class IndexedPrimitiveTable
+	{
+	public:
+		explicit IndexedPrimitiveTable(size_t expectedCount)
+		{
+			// At most half full, so that probe sequences stay short
+			const size_t capacity = std::bit_ceil(std::max<size_t>(expectedCount * 2, 16));
+			m_Mask = capacity - 1;
+			m_Keys.assign(capacity, { EMPTY, EMPTY, EMPTY });
+			m_Values.resize(capacity);
+		}
+
+		// Returns the value already stored for the key, or stores and returns the given one
+		std::uint32_t Insert(const IndexedPrimitive& key, std::uint32_t value)
+		{
+			for (size_t slot = Hash(key) & m_Mask;; slot = (slot + 1) & m_Mask)
+			{
+				if (m_Keys[slot].posIdx == EMPTY)
+				{
+					m_Keys[slot] = key;
+					m_Values[slot] = value;
+					return value;
+				}
+				if (m_Keys[slot] == key)
+					return m_Values[slot];
+			}
+		}
+
+	private:
+		// Position indices are always set, so they mark the free slots
+		static constexpr std::uint32_t EMPTY = UINT32_MAX;
+
+		static size_t Hash(const IndexedPrimitive& key)
+		{
+			std::uint64_t hash = key.posIdx * 0x9E3779B97F4A7C15ull;
+			hash ^= (key.normalIdx + 0x632BE59BD9B4E019ull) * 0xC2B2AE3D27D4EB4Full;
+			hash ^= (key.uvIdx + 0x85EBCA77C2B2AE63ull) * 0x165667B19E3779F9ull;
+			return static_cast<size_t>(hash ^ (hash >> 29));
+		}
+
+		std::vector<IndexedPrimitive> m_Keys;
+		std::vector<std::uint32_t> m_Values;
+		size_t m_Mask = 0;
+	};
+
+	// Gathers the attributes of an OBJ vertex
+	VertexInput MakeVertex(const tinyobj::attrib_t& attribs, const tinyobj::index_t& index)
+	{
+		glm::vec3 pos(attribs.vertices[3 * index.vertex_index], attribs.vertices[3 * index.vertex_index + 1], attribs.vertices[3 * index.vertex_index + 2]);
+
+		glm::vec3 normal(0.f);
+		if (index.normal_index != -1)
+		{
+			normal.x = attribs.normals[3 * index.normal_index];
+			normal.y = attribs.normals[3 * index.normal_index + 1];
+			normal.z = attribs.normals[3 * index.normal_index + 2];
+		}
+
+		glm::vec2 uv(0.f);
+		if (index.texcoord_index != -1)
+		{
+			uv.s = glm::abs(attribs.texcoords[2 * index.texcoord_index]);
+			uv.t = glm::abs(1.f - attribs.texcoords[2 * index.texcoord_index + 1]);
+		}
+
+		return { pos, normal, uv };
+	}
+}
+
 void Scene::LoadObject(std::string_view fileName)
 {
 	tinyobj::attrib_t attribs;
 	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	std::vector<tinyobj::material_t> objMaterials;
 	std::string err = "";
 
-	bool isLoaded = tinyobj::LoadObj(&attribs, &shapes, &materials, nullptr, &err, fileName.data(), "../assets/", true /*triangulate*/, true /*default_vcols_fallback*/);
+	bool isLoaded = tinyobj::LoadObj(&attribs, &shapes, &objMaterials, nullptr, &err, fileName.data(), "../assets/", true /*triangulate*/, true /*default_vcols_fallback*/);
 	if (isLoaded)
 	{
-		//Get all materials
-		for (size_t i = 0; i < materials.size(); i++)
+		//Get all materials, appended after the ones of previously loaded objects
+		const std::uint32_t materialBase = static_cast<std::uint32_t>(materials.size());
+		for (size_t i = 0; i < objMaterials.size(); i++)
 		{
-			const tinyobj::material_t& mat = materials[i];
+			const tinyobj::material_t& mat = objMaterials[i];
+			assert(!mat.diffuse_texname.empty() && "Mesh missing texture!");
 
-			std::string_view diffuseTexName = mat.diffuse_texname;
-			assert(!diffuseTexName.empty() && "Mesh missing texture!");
+			Material material;
+			material.name = mat.name;
+			material.pDiffuse = LoadTexture(mat.diffuse_texname);
+			material.normalTexName = mat.normal_texname.empty() ? mat.bump_texname : mat.normal_texname;
+			material.specularTexName = mat.specular_texname;
+			materials.push_back(material);
+		}
 
-			if (textures.find(diffuseTexName.data()) == textures.end())
+		// Textures decode in the background while the geometry is imported, the Rasterizer waiting for them
+		DecodeTextures();
+
+		// Every shape is imported on its own into a local vertex and index list, deduplicating its vertices in a hash table.
+		// Shapes rarely share vertices, so this gives nearly the same vertex buffer as a global deduplication, in parallel
+		std::vector<ShapeImport> imports(shapes.size());
+		#pragma omp parallel for schedule(dynamic)
+		for (int shapeIndex = 0; shapeIndex < static_cast<int>(shapes.size()); shapeIndex++)
+		{
+			const tinyobj::shape_t& currentShape = shapes[shapeIndex];
+			ShapeImport& shapeImport = imports[shapeIndex];
+			const size_t indexCount = currentShape.mesh.indices.size();
+
+			shapeImport.indices.resize(indexCount);
+			shapeImport.vertices.reserve(indexCount / 2);
+			IndexedPrimitiveTable indexedPrims(indexCount);
+			for (size_t i = 0; i < indexCount; i++)
 			{
-				std::string fileName = std::string("../assets/") + diffuseTexName.data();
+				const tinyobj::index_t& index = currentShape.mesh.indices[i];
+
+				IndexedPrimitive prim;
 
-				Texture* pAlbedo = new Texture();
-				pAlbedo->data = stbi_load(fileName.data(), &pAlbedo->width, &pAlbedo->height, &pAlbedo->numChannels, 0);
-				assert(pAlbedo->data != nullptr && "Failed to load image!");
+				//Set vertex index if existing
+				assert(index.vertex_index != -1);
+				prim.posIdx = index.vertex_index;
+
+				//Set Normal and UV indices if existing
+				prim.normalIdx = index.normal_index != -1 ? index.normal_index : UINT32_MAX;
+				prim.uvIdx = index.texcoord_index != -1 ? index.texcoord_index : UINT32_MAX;
 
-				//Set textures
-				textures[diffuseTexName.data()] = pAlbedo;
+				// New unique vertex found: get its data, otherwise just reuse the index of the existing one
+				const std::uint32_t newIdx = static_cast<std::uint32_t>(shapeImport.vertices.size());
+				const std::uint32_t vertexIdx = indexedPrims.Insert(prim, newIdx);
+				if (vertexIdx == newIdx)
+					shapeImport.vertices.push_back(MakeVertex(attribs, index));
+				shapeImport.indices[i] = vertexIdx;
 			}
 		}
-		std::map<IndexedPrimitive, std::uint32_t> indexedPrims;
+
+		// Offsets of every shape in the scene buffers, which are then sized once
+		size_t vertexCount = vertexBuffer.size();
+		size_t indexCount = indexBuffer.size();
+		std::vector<size_t> vertexOffsets(shapes.size());
+		std::vector<size_t> indexOffsets(shapes.size());
 		for (size_t shapeIndex = 0; shapeIndex < shapes.size(); shapeIndex++)
 		{
+			vertexOffsets[shapeIndex] = vertexCount;
+			indexOffsets[shapeIndex] = indexCount;
+			vertexCount += imports[shapeIndex].vertices.size();
+			indexCount += imports[shapeIndex].indices.size();
+
+			// Push new mesh to be rendered in the scene
 			const tinyobj::shape_t& currentShape = shapes[shapeIndex];
+			Mesh mesh;
+			mesh.idxOffset = static_cast<std::uint32_t>(indexOffsets[shapeIndex]);
+			mesh.idxCount = static_cast<std::uint32_t>(currentShape.mesh.indices.size());
 
-			std::uint32_t meshIdxBase = indexBuffer.size();
-			for (size_t i = 0; i < currentShape.mesh.indices.size(); i++)
-			{
-				auto index = currentShape.mesh.indices[i];
+			assert((currentShape.mesh.material_ids[0] != -1) && "Mesh missing a material!");
+			mesh.materialIdx = materialBase + currentShape.mesh.material_ids[0]; // No per-face material but fixed one
+			primitives.push_back(mesh);
+		}
+		vertexBuffer.resize(vertexCount);
+		indexBuffer.resize(indexCount);
 
-				IndexedPrimitive prim;
+		#pragma omp parallel for schedule(dynamic)
+		for (int shapeIndex = 0; shapeIndex < static_cast<int>(shapes.size()); shapeIndex++)
+		{
+			const ShapeImport& shapeImport = imports[shapeIndex];
+			std::copy(shapeImport.vertices.begin(), shapeImport.vertices.end(), vertexBuffer.begin() + vertexOffsets[shapeIndex]);
 
-				//Set vertex index if existing
-				int vtxIdx = index.vertex_index;
-				assert(vtxIdx != -1);
-				prim.posIdx = vtxIdx;
+			const std::uint32_t vertexBase = static_cast<std::uint32_t>(vertexOffsets[shapeIndex]);
+			std::transform(shapeImport.indices.begin(), shapeImport.indices.end(), indexBuffer.begin() + indexOffsets[shapeIndex],
+				[vertexBase](std::uint32_t index) { return index + vertexBase; });
+		}
 
-				//Set Normal index if existing
-				bool hasNormals = index.normal_index != -1;
-				int normalIdx = index.normal_index;
-				prim.normalIdx = hasNormals ? normalIdx : UINT32_MAX;
+		BuildBvh();
+	}
+	else
+	{
+		std::cout << "ERROR " << err << "\n";
+		assert(false && "Failed to load .OBJ file, check file paths!");
+	}
 
-				//Set UV index if existing
-				bool hasUV = index.texcoord_index != -1;
-				int uvIdx = index.texcoord_index;
-				prim.uvIdx = hasUV ? uvIdx : UINT32_MAX;
+}
 
+Texture* Scene::LoadTexture(const std::string& name)
+{
+	auto it = textures.find(name);
+	if (it != textures.end())
+		return it->second;
 
-				auto res = indexedPrims.find(prim);
-				// Vertex is already defined in terms of POS/NORMAL/UV indices, just append index data to index buffer
-				if (res != indexedPrims.end())
-				{
-					indexBuffer.push_back(res->second);
-				}
-				// New unique vertex found, get vertex data and append it to vertex buffer and update indexed primitives
-				else
+	// Only registered here, decoded by the workers started by DecodeTextures
+	Texture* pTexture = new Texture();
+	m_TextureQueue.emplace_back(std::string("../assets/") + name, pTexture);
+
+	//Set textures
+	textures[name] = pTexture;
+	return pTexture;
+}
+
+void Scene::DecodeTextures()
+{
+	if (m_TextureQueue.empty())
+		return;
+
+	// Workers pull textures from a shared list, so that a few large images do not end up on the same worker.
+	// They only reference heap allocations, the Scene can be moved meanwhile
+	struct DecodeQueue
+	{
+		std::vector<std::pair<std::string, Texture*>> textures;
+		std::atomic<size_t> next{ 0 };
+	};
+	auto pQueue = std::make_shared<DecodeQueue>();
+	pQueue->textures = std::move(m_TextureQueue);
+	m_TextureQueue.clear();
+
+	// Half of the cores: the geometry import and the BVH build that run meanwhile fill every core with OpenMP threads
+	const size_t workerCount = std::min<size_t>(std::max(std::thread::hardware_concurrency() / 2, 1u), pQueue->textures.size());
+	for (size_t worker = 0; worker < workerCount; worker++)
+	{
+		m_TextureWorkers.push_back(std::async(std::launch::async, [pQueue, pCancelled = m_DecodeCancelled]()
+			{
+				for (size_t i = pQueue->next.fetch_add(1); i < pQueue->textures.size() && !pCancelled->load(); i = pQueue->next.fetch_add(1))
 				{
-					auto newIdx = vertexBuffer.size();
-					indexedPrims[prim] = newIdx;
-					indexBuffer.push_back(newIdx);
-
-
-					auto vx = attribs.vertices[3 * index.vertex_index];
-					auto vy = attribs.vertices[3 * index.vertex_index + 1];
-					auto vz = attribs.vertices[3 * index.vertex_index + 2];
-					glm::vec3 pos(vx, vy, vz);
-
-					glm::vec3 normal(0.f);
-					if (hasNormals)
-					{
-						auto nx = attribs.normals[3 * index.normal_index];
-						auto ny = attribs.normals[3 * index.normal_index + 1];
-						auto nz = attribs.normals[3 * index.normal_index + 2];
-
-						normal.x = nx;
-						normal.y = ny;
-						normal.z = nz;
-					}
-
-					glm::vec2 uv(0.f);
-					if (hasUV)
-					{
-						auto ux = attribs.texcoords[2 * index.texcoord_index];
-						auto uy = 1.f - attribs.texcoords[2 * index.texcoord_index + 1];
-
-						uv.s = glm::abs(ux);
-						uv.t = glm::abs(uy);
-					}
-
-					VertexInput uniqueVertex = { pos, normal, uv };
-					vertexBuffer.push_back(uniqueVertex);
+#if TRACY_ENABLE
+					ZoneScopedN("DecodeTexture");
+#endif
+					const auto& [fileName, pTexture] = pQueue->textures[i];
+					pTexture->data = stbi_load(fileName.data(), &pTexture->width, &pTexture->height, &pTexture->numChannels, 0);
+					assert(pTexture->data != nullptr && "Failed to load image!");
+					pTexture->GenerateMipChain();
+
+					// Only the mip chain is sampled, the source image is not needed anymore
+					stbi_image_free(pTexture->data);
+					pTexture->data = nullptr;
 				}
-			}
-				// Push new mesh to be rendered in the scene 
-				Mesh mesh;
-				mesh.idxOffset = meshIdxBase;
-				mesh.idxCount = currentShape.mesh.indices.size();
+			}));
+	}
+}
+
+void Scene::WaitForTextures()
+{
+#if TRACY_ENABLE
+	ZoneScopedN("WaitForTextures");
+#endif
+	// Textures registered outside of LoadObject are not started yet
+	DecodeTextures();
+	for (std::future<void>& worker : m_TextureWorkers)
+		worker.get();
+	m_TextureWorkers.clear();
+}
+
+namespace
+{
+	// Scene cache layout: a header followed by sections at the recorded offsets, each aligned on a cache line so that the
+	// mapped texel tiles keep the alignment of TexelTile. Bump the version whenever any of the records below changes
+	constexpr char CACHE_MAGIC[8] = { 'R', 'S', 'C', 'A', 'C', 'H', 'E', '\0' };
+	constexpr std::uint32_t CACHE_VERSION = 2u;
+	constexpr std::uint64_t CACHE_ALIGNMENT = alignof(TexelTile);
+
+	// Range of the string section
+	struct CachedString
+	{
+		std::uint32_t offset = 0u;
+		std::uint32_t length = 0u;
+	};
+
+	// Size and last write time of the file a cache was built from, both 0 without source file
+	struct CachedSource
+	{
+		std::uint64_t size = 0u;
+		std::int64_t writeTime = 0;
+
+		bool operator==(const CachedSource& other) const = default;
+	};
+
+	CachedSource GetCachedSource(std::string_view sourceName)
+	{
+		CachedSource source;
+		if (sourceName.empty())
+			return source;
+
+		// A source that cannot be read never matches a cache, which is then rebuilt from it
+		std::error_code error;
+		const std::filesystem::path path(sourceName);
+		const std::uintmax_t size = std::filesystem::file_size(path, error);
+		const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path, error);
+		if (error)
+			return { ~0ull, -1 };
+		source.size = size;
+		source.writeTime = writeTime.time_since_epoch().count();
+		return source;
+	}
+
+	struct CacheHeader
+	{
+		char magic[8];
+		std::uint32_t version;
+		// Guards against caches written by a build with another vertex layout
+		std::uint32_t vertexSize;
+		std::uint32_t vertexCount;
+		std::uint32_t indexCount;
+		std::uint32_t meshCount;
+		std::uint32_t materialCount;
+		std::uint32_t textureCount;
+		std::uint32_t stringSize;
+		std::uint64_t vertexOffset;
+		std::uint64_t indexOffset;
+		std::uint64_t meshOffset;
+		std::uint64_t materialOffset;
+		std::uint64_t textureOffset;
+		std::uint64_t stringOffset;
+		// Guards against caches of a source file edited since
+		CachedSource source;
+	};
+
+	struct CachedMesh
+	{
+		std::uint32_t idxOffset;
+		std::uint32_t idxCount;
+		std::uint32_t materialIdx;
+	};
+
+	struct CachedMaterial
+	{
+		CachedString name;
+		CachedString normalTexName;
+		CachedString specularTexName;
+		// Index into the texture section, -1 without diffuse map
+		std::int32_t diffuse;
+	};
+
+	struct CachedTexture
+	{
+		CachedString name;
+		std::int32_t width;
+		std::int32_t height;
+		std::int32_t numChannels;
+		std::uint32_t mipCount;
+		// MipLevel records, then the tiles of every level
+		std::uint64_t mipOffset;
+		std::uint64_t tileOffset;
+		std::uint64_t tileCount;
+	};
+
+	std::uint64_t AlignCacheOffset(std::uint64_t offset)
+	{
+		return (offset + CACHE_ALIGNMENT - 1) & ~(CACHE_ALIGNMENT - 1);
+	}
 
-				assert((shapes[shapeIndex].mesh.material_ids[0] != -1) && "Mesh missing a material!");
-				mesh.diffuseTexName = materials[currentShape.mesh.material_ids[0]].diffuse_texname; // No per-face material but fixed one
-				primitives.push_back(mesh);
+	// Returns the typed records of a section, or nullptr if they do not fit in the file
+	template<typename T>
+	const T* GetCacheSection(const MappedFile& file, std::uint64_t offset, std::uint64_t count)
+	{
+		if (offset % alignof(T) != 0 || offset > file.GetSize() || count > (file.GetSize() - offset) / sizeof(T))
+			return nullptr;
+		return reinterpret_cast<const T*>(file.GetData() + offset);
+	}
+
+	bool IsValidCachedString(const CachedString& string, std::uint32_t stringSize)
+	{
+		return string.offset <= stringSize && string.length <= stringSize - string.offset;
+	}
 
+	// Every level of the chain must have a size and fit, padded to whole tiles, in the tiles of its texture
+	bool IsValidCachedMipChain(const MipLevel* pMips, std::uint32_t mipCount, std::uint64_t tileCount)
+	{
+		if (mipCount == 0)
+			return false;
+		constexpr std::uint64_t tileTexels = MipLevel::TILE_SIZE * MipLevel::TILE_SIZE;
+		for (std::uint32_t i = 0; i < mipCount; i++)
+		{
+			const MipLevel& mip = pMips[i];
+			if (mip.width <= 0 || mip.height <= 0 || mip.tilesX != (mip.width + MipLevel::TILE_SIZE - 1) >> MipLevel::TILE_SHIFT)
+				return false;
+			const std::uint64_t tilesY = (static_cast<std::uint64_t>(mip.height) + MipLevel::TILE_SIZE - 1) >> MipLevel::TILE_SHIFT;
+			if (mip.offset % tileTexels != 0 || mip.offset / tileTexels + tilesY * mip.tilesX > tileCount)
+				return false;
 		}
+		return true;
 	}
-	else
+}
+
+bool Scene::LoadCache(std::string_view fileName, std::string_view sourceName)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("LoadCache");
+#endif
+	MappedFile file;
+	if (!file.Open(fileName))
+		return false;
+
+	const CacheHeader* pHeader = GetCacheSection<CacheHeader>(file, 0, 1);
+	if (pHeader == nullptr || memcmp(pHeader->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+		pHeader->version != CACHE_VERSION || pHeader->vertexSize != sizeof(VertexInput) || pHeader->source != GetCachedSource(sourceName))
+		return false;
+
+	const VertexInput* pVertices = GetCacheSection<VertexInput>(file, pHeader->vertexOffset, pHeader->vertexCount);
+	const std::uint32_t* pIndices = GetCacheSection<std::uint32_t>(file, pHeader->indexOffset, pHeader->indexCount);
+	const CachedMesh* pMeshes = GetCacheSection<CachedMesh>(file, pHeader->meshOffset, pHeader->meshCount);
+	const CachedMaterial* pMaterials = GetCacheSection<CachedMaterial>(file, pHeader->materialOffset, pHeader->materialCount);
+	const CachedTexture* pTextures = GetCacheSection<CachedTexture>(file, pHeader->textureOffset, pHeader->textureCount);
+	const char* pStrings = GetCacheSection<char>(file, pHeader->stringOffset, pHeader->stringSize);
+	if (pVertices == nullptr || pIndices == nullptr || pMeshes == nullptr || pMaterials == nullptr || pTextures == nullptr || pStrings == nullptr)
+		return false;
+
+	// Every record is checked before the scene is touched, so that a corrupt cache leaves it as it was
+	const std::uint32_t stringSize = pHeader->stringSize;
+	for (std::uint32_t i = 0; i < pHeader->textureCount; i++)
 	{
-		std::cout << "ERROR " << err << "\n";
-		assert(false && "Failed to load .OBJ file, check file paths!");
+		const MipLevel* pMips = GetCacheSection<MipLevel>(file, pTextures[i].mipOffset, pTextures[i].mipCount);
+		if (pMips == nullptr || GetCacheSection<TexelTile>(file, pTextures[i].tileOffset, pTextures[i].tileCount) == nullptr ||
+			!IsValidCachedMipChain(pMips, pTextures[i].mipCount, pTextures[i].tileCount) || !IsValidCachedString(pTextures[i].name, stringSize))
+			return false;
+	}
+	for (std::uint32_t i = 0; i < pHeader->materialCount; i++)
+	{
+		const CachedMaterial& cachedMaterial = pMaterials[i];
+		if (cachedMaterial.diffuse < -1 || cachedMaterial.diffuse >= static_cast<std::int64_t>(pHeader->textureCount) ||
+			!IsValidCachedString(cachedMaterial.name, stringSize) || !IsValidCachedString(cachedMaterial.normalTexName, stringSize) ||
+			!IsValidCachedString(cachedMaterial.specularTexName, stringSize))
+			return false;
+	}
+	for (std::uint32_t i = 0; i < pHeader->meshCount; i++)
+	{
+		const CachedMesh& cachedMesh = pMeshes[i];
+		if (cachedMesh.materialIdx >= pHeader->materialCount ||
+			static_cast<std::uint64_t>(cachedMesh.idxOffset) + cachedMesh.idxCount > pHeader->indexCount)
+			return false;
+	}
+	const std::uint32_t vertexCount = pHeader->vertexCount;
+	if (std::any_of(pIndices, pIndices + pHeader->indexCount, [vertexCount](std::uint32_t index) { return index >= vertexCount; }))
+		return false;
+
+	auto getString = [pStrings](const CachedString& string) { return std::string(pStrings + string.offset, string.length); };
+
+	// Textures are shared by name with the ones already in the scene, new ones sample the mapped tiles in place
+	std::vector<Texture*> cachedTextures(pHeader->textureCount);
+	for (std::uint32_t i = 0; i < pHeader->textureCount; i++)
+	{
+		const CachedTexture& cachedTexture = pTextures[i];
+		Texture*& pTexture = textures[getString(cachedTexture.name)];
+		if (pTexture == nullptr)
+		{
+			const MipLevel* pMips = reinterpret_cast<const MipLevel*>(file.GetData() + cachedTexture.mipOffset);
+			pTexture = new Texture();
+			pTexture->width = cachedTexture.width;
+			pTexture->height = cachedTexture.height;
+			pTexture->numChannels = cachedTexture.numChannels;
+			pTexture->mips.assign(pMips, pMips + cachedTexture.mipCount);
+			pTexture->pMappedTiles = reinterpret_cast<const TexelTile*>(file.GetData() + cachedTexture.tileOffset);
+		}
+		cachedTextures[i] = pTexture;
+	}
+
+	const std::uint32_t materialBase = static_cast<std::uint32_t>(materials.size());
+	for (std::uint32_t i = 0; i < pHeader->materialCount; i++)
+	{
+		const CachedMaterial& cachedMaterial = pMaterials[i];
+		Material material;
+		material.name = getString(cachedMaterial.name);
+		material.pDiffuse = cachedMaterial.diffuse >= 0 ? cachedTextures[cachedMaterial.diffuse] : nullptr;
+		material.normalTexName = getString(cachedMaterial.normalTexName);
+		material.specularTexName = getString(cachedMaterial.specularTexName);
+		materials.push_back(material);
+	}
+
+	const std::uint32_t vertexBase = static_cast<std::uint32_t>(vertexBuffer.size());
+	const std::uint32_t indexBase = static_cast<std::uint32_t>(indexBuffer.size());
+	for (std::uint32_t i = 0; i < pHeader->meshCount; i++)
+	{
+		Mesh mesh;
+		mesh.idxOffset = indexBase + pMeshes[i].idxOffset;
+		mesh.idxCount = pMeshes[i].idxCount;
+		mesh.materialIdx = materialBase + pMeshes[i].materialIdx;
+		primitives.push_back(mesh);
+	}
+
+	vertexBuffer.insert(vertexBuffer.end(), pVertices, pVertices + pHeader->vertexCount);
+	indexBuffer.resize(indexBase + pHeader->indexCount);
+	std::transform(pIndices, pIndices + pHeader->indexCount, indexBuffer.begin() + indexBase,
+		[vertexBase](std::uint32_t index) { return index + vertexBase; });
+
+	m_MappedFiles.push_back(std::move(file));
+	BuildBvh();
+	return true;
+}
+
+void Scene::WriteCache(std::string_view fileName, std::string_view sourceName)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("WriteCache");
+#endif
+	WaitForTextures();
+
+	std::string strings;
+	auto addString = [&strings](const std::string& string)
+		{
+			CachedString cachedString{ static_cast<std::uint32_t>(strings.size()), static_cast<std::uint32_t>(string.size()) };
+			strings += string;
+			return cachedString;
+		};
+
+	// Layout of every section first, textures following the order of the texture map
+	CacheHeader header{};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.vertexSize = sizeof(VertexInput);
+	header.vertexCount = static_cast<std::uint32_t>(vertexBuffer.size());
+	header.indexCount = static_cast<std::uint32_t>(indexBuffer.size());
+	header.meshCount = static_cast<std::uint32_t>(primitives.size());
+	header.materialCount = static_cast<std::uint32_t>(materials.size());
+	header.textureCount = static_cast<std::uint32_t>(textures.size());
+	header.source = GetCachedSource(sourceName);
+
+	header.vertexOffset = AlignCacheOffset(sizeof(CacheHeader));
+	header.indexOffset = AlignCacheOffset(header.vertexOffset + vertexBuffer.size() * sizeof(VertexInput));
+	header.meshOffset = AlignCacheOffset(header.indexOffset + indexBuffer.size() * sizeof(std::uint32_t));
+	header.materialOffset = AlignCacheOffset(header.meshOffset + primitives.size() * sizeof(CachedMesh));
+	header.textureOffset = AlignCacheOffset(header.materialOffset + materials.size() * sizeof(CachedMaterial));
+	std::uint64_t offset = AlignCacheOffset(header.textureOffset + textures.size() * sizeof(CachedTexture));
+
+	std::map<const Texture*, std::int32_t> textureIndices;
+	std::vector<CachedTexture> cachedTextures;
+	for (const auto& [name, pTexture] : textures)
+	{
+		assert(!pTexture->mips.empty() && "Texture without mip chain!");
+		CachedTexture cachedTexture;
+		cachedTexture.name = addString(name);
+		cachedTexture.width = pTexture->width;
+		cachedTexture.height = pTexture->height;
+		cachedTexture.numChannels = pTexture->numChannels;
+		cachedTexture.mipCount = static_cast<std::uint32_t>(pTexture->mips.size());
+		cachedTexture.mipOffset = offset;
+		cachedTexture.tileOffset = AlignCacheOffset(offset + pTexture->mips.size() * sizeof(MipLevel));
+		const MipLevel& lastMip = pTexture->mips.back();
+		cachedTexture.tileCount = (lastMip.offset >> (2 * MipLevel::TILE_SHIFT)) + 1;
+		offset = AlignCacheOffset(cachedTexture.tileOffset + cachedTexture.tileCount * sizeof(TexelTile));
+
+		textureIndices[pTexture] = static_cast<std::int32_t>(cachedTextures.size());
+		cachedTextures.push_back(cachedTexture);
+	}
+
+	std::vector<CachedMaterial> cachedMaterials;
+	for (const Material& material : materials)
+	{
+		CachedMaterial cachedMaterial;
+		cachedMaterial.name = addString(material.name);
+		cachedMaterial.normalTexName = addString(material.normalTexName);
+		cachedMaterial.specularTexName = addString(material.specularTexName);
+		auto it = textureIndices.find(material.pDiffuse);
+		cachedMaterial.diffuse = it != textureIndices.end() ? it->second : -1;
+		cachedMaterials.push_back(cachedMaterial);
+	}
+
+	std::vector<CachedMesh> cachedMeshes;
+	for (const Mesh& mesh : primitives)
+		cachedMeshes.push_back({ mesh.idxOffset, mesh.idxCount, mesh.materialIdx });
+
+	header.stringOffset = offset;
+	header.stringSize = static_cast<std::uint32_t>(strings.size());
+
+	std::ofstream stream(std::string(fileName), std::ios::binary | std::ios::trunc);
+	assert(stream.is_open() && "Failed to open the scene cache for writing!");
+
+	// Sections are written in offset order, padding up to each of them
+	std::uint64_t position = 0;
+	auto writeSection = [&stream, &position](std::uint64_t sectionOffset, const void* pData, std::uint64_t size)
+		{
+			static const char padding[CACHE_ALIGNMENT] = {};
+			assert(sectionOffset >= position && sectionOffset - position < CACHE_ALIGNMENT);
+			stream.write(padding, sectionOffset - position);
+			stream.write(static_cast<const char*>(pData), size);
+			position = sectionOffset + size;
+		};
+
+	writeSection(0, &header, sizeof(header));
+	writeSection(header.vertexOffset, vertexBuffer.data(), vertexBuffer.size() * sizeof(VertexInput));
+	writeSection(header.indexOffset, indexBuffer.data(), indexBuffer.size() * sizeof(std::uint32_t));
+	writeSection(header.meshOffset, cachedMeshes.data(), cachedMeshes.size() * sizeof(CachedMesh));
+	writeSection(header.materialOffset, cachedMaterials.data(), cachedMaterials.size() * sizeof(CachedMaterial));
+	writeSection(header.textureOffset, cachedTextures.data(), cachedTextures.size() * sizeof(CachedTexture));
+
+	size_t textureIndex = 0;
+	for (const auto& [name, pTexture] : textures)
+	{
+		const CachedTexture& cachedTexture = cachedTextures[textureIndex++];
+		writeSection(cachedTexture.mipOffset, pTexture->mips.data(), pTexture->mips.size() * sizeof(MipLevel));
+		writeSection(cachedTexture.tileOffset, pTexture->GetTexels(), cachedTexture.tileCount * sizeof(TexelTile));
+	}
+
+	writeSection(header.stringOffset, strings.data(), strings.size());
+	assert(stream.good() && "Failed to write the scene cache!");
+}
+
+void Scene::BuildBvh()
+{
+#if TRACY_ENABLE
+	ZoneScopedN("BuildBvh");
+#endif
+	// Clusters of a mesh are contiguous, the first one of every mesh is known upfront so meshes can be processed in parallel
+	std::vector<std::uint32_t> clusterOffsets(primitives.size() + 1, 0u);
+	for (size_t i = 0; i < primitives.size(); i++)
+	{
+		const std::uint32_t triCount = primitives[i].idxCount / 3;
+		clusterOffsets[i + 1] = clusterOffsets[i] + (triCount + Bvh::CLUSTER_SIZE - 1) / Bvh::CLUSTER_SIZE;
+	}
+	clusters.resize(clusterOffsets.back());
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < static_cast<int>(primitives.size()); i++)
+	{
+		Mesh& mesh = primitives[i];
+		assert(mesh.idxOffset % 3 == 0 && "Mesh not starting on a triangle boundary!");
+		const std::uint32_t triCount = mesh.idxCount / 3;
+
+		// Split into clusters of consecutive triangles, keeping the submission order: OBJ exporters write faces in a
+		// spatially coherent order, and sorting them would change the draw order the depth test relies on to limit overdraw
+		mesh.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+		mesh.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+		for (std::uint32_t c = clusterOffsets[i]; c < clusterOffsets[i + 1]; c++)
+		{
+			Cluster& cluster = clusters[c];
+			const std::uint32_t firstTriangle = (c - clusterOffsets[i]) * Bvh::CLUSTER_SIZE;
+			cluster.mesh = static_cast<std::uint32_t>(i);
+			cluster.idxOffset = mesh.idxOffset + firstTriangle * 3;
+			cluster.triangleCount = std::min(Bvh::CLUSTER_SIZE, triCount - firstTriangle);
+
+			cluster.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+			cluster.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+			for (std::uint32_t k = 0; k < cluster.triangleCount * 3; k++)
+			{
+				const glm::vec3& pos = vertexBuffer[indexBuffer[cluster.idxOffset + k]].pos;
+				cluster.boundsMin = glm::min(cluster.boundsMin, pos);
+				cluster.boundsMax = glm::max(cluster.boundsMax, pos);
+			}
+
+			mesh.boundsMin = glm::min(mesh.boundsMin, cluster.boundsMin);
+			mesh.boundsMax = glm::max(mesh.boundsMax, cluster.boundsMax);
+		}
 	}
 
+	bvh.Build(clusters);
 }
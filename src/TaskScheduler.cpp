@@ -0,0 +1,161 @@
+#include "TaskScheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#if TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif // TRACY_ENABLE
+
+namespace
+{
+	// Set on the worker threads, so that nested loops push to the deque of the worker running them
+	thread_local const TaskScheduler* t_pScheduler = nullptr;
+	thread_local std::uint32_t t_WorkerIndex = 0u;
+}
+
+TaskScheduler::TaskScheduler(std::uint32_t threadCount)
+	: m_Deques(threadCount > 0u ? threadCount : std::max(std::thread::hardware_concurrency(), 1u))
+{
+	// Deque 0 belongs to the threads calling ParallelFor
+	m_Workers.reserve(m_Deques.size() - 1);
+	for (std::uint32_t index = 1; index < m_Deques.size(); index++)
+		m_Workers.emplace_back(&TaskScheduler::WorkerLoop, this, index);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+		m_IsStopping.store(true, std::memory_order_relaxed);
+	}
+	m_WakeUp.notify_all();
+	for (std::thread& worker : m_Workers)
+		worker.join();
+}
+
+TaskScheduler& TaskScheduler::GetDefault()
+{
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+void TaskScheduler::Run(std::uint32_t begin, std::uint32_t end, std::uint32_t grain, RangeCallback callback, const void* pContext)
+{
+#if TRACY_ENABLE
+	ZoneScopedN("ParallelFor");
+#endif
+	grain = std::max(grain, 1u);
+	const std::uint32_t chunkCount = (end - begin - 1) / grain + 1;
+	const std::uint32_t threadCount = GetThreadCount();
+	const std::uint32_t current = GetCurrentIndex();
+
+	Job job;
+	job.callback = callback;
+	job.pContext = pContext;
+	job.remaining.store(chunkCount, std::memory_order_relaxed);
+	m_Pending.fetch_add(chunkCount, std::memory_order_relaxed);
+
+	// Every deque gets a contiguous run of chunks, the calling thread the first one. Chunks are pushed last to first
+	// so the owner walks its run in memory order while thieves take the far end
+	for (std::uint32_t i = 0; i < threadCount; i++)
+	{
+		const std::uint32_t firstChunk = static_cast<std::uint32_t>(static_cast<std::uint64_t>(chunkCount) * i / threadCount);
+		const std::uint32_t lastChunk = static_cast<std::uint32_t>(static_cast<std::uint64_t>(chunkCount) * (i + 1) / threadCount);
+		if (firstChunk == lastChunk)
+			continue;
+
+		TaskDeque& deque = m_Deques[(current + i) % threadCount];
+		std::lock_guard<std::mutex> lock(deque.mutex);
+		for (std::uint32_t chunk = lastChunk; chunk-- > firstChunk;)
+			deque.tasks.push_back({ &job, begin + chunk * grain, std::min(begin + (chunk + 1) * grain, end) });
+	}
+
+	// Sleeping workers are only woken up if the spinning ones may not be enough
+	{
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+	}
+	if (chunkCount >= threadCount)
+		m_WakeUp.notify_all();
+	else
+		for (std::uint32_t i = 1; i < chunkCount; i++)
+			m_WakeUp.notify_one();
+
+	// Help until the last chunk is done, possibly running chunks of other loops meanwhile
+	Task task;
+	while (job.remaining.load(std::memory_order_acquire) > 0u)
+	{
+		if (FindTask(current, task))
+			Execute(task);
+		else
+			std::this_thread::yield();
+	}
+}
+
+void TaskScheduler::WorkerLoop(std::uint32_t index)
+{
+	t_pScheduler = this;
+	t_WorkerIndex = index;
+
+	Task task;
+	while (!m_IsStopping.load(std::memory_order_relaxed))
+	{
+		if (FindTask(index, task))
+		{
+			Execute(task);
+			continue;
+		}
+
+		// Spin a little first, the next loop of the frame usually comes right after
+		for (std::uint32_t spin = 0; spin < SPIN_COUNT && m_Pending.load(std::memory_order_relaxed) <= 0; spin++)
+			std::this_thread::yield();
+
+		std::unique_lock<std::mutex> lock(m_SleepMutex);
+		m_WakeUp.wait(lock, [this]() { return m_IsStopping.load(std::memory_order_relaxed) || m_Pending.load(std::memory_order_relaxed) > 0; });
+	}
+}
+
+bool TaskScheduler::FindTask(std::uint32_t index, Task& task)
+{
+	const std::uint32_t threadCount = GetThreadCount();
+	{
+		TaskDeque& own = m_Deques[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty())
+		{
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			m_Pending.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	// Steal the oldest task of the next deque having one, a busy deque is skipped rather than waited for
+	for (std::uint32_t i = 1; i < threadCount; i++)
+	{
+		TaskDeque& victim = m_Deques[(index + i) % threadCount];
+		std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+		if (!lock.owns_lock() || victim.tasks.empty())
+			continue;
+
+		task = victim.tasks.front();
+		victim.tasks.pop_front();
+		m_Pending.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void TaskScheduler::Execute(const Task& task)
+{
+	Job* pJob = task.pJob;
+	pJob->callback(pJob->pContext, task.begin, task.end);
+
+	// The job may be gone as soon as its last chunk is counted
+	pJob->remaining.fetch_sub(1u, std::memory_order_release);
+}
+
+std::uint32_t TaskScheduler::GetCurrentIndex() const
+{
+	return t_pScheduler == this ? t_WorkerIndex : 0u;
+}
@@ -1,6 +1,73 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
 #include "Rasterizer.hpp"
+#include "PngEncoder.hpp"
+
+// Small scene made of two overlapping textured quads, used to compare the different render paths
+static Scene MakeQuadScene()
+{
+	// Allocated like stb_image does (malloc by default), the Scene frees it
+	stbi_uc* texels = static_cast<stbi_uc*>(std::malloc(4 * 4 * 3));
+	for (int i = 0; i < 4 * 4 * 3; i++)
+		texels[i] = static_cast<stbi_uc>(i * 5);
+
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(100.f);
+	camera.SetEyePosition(glm::vec3(0, 2, 9));
+	camera.SetLookDirection(glm::vec3(0, 0, 0));
+	camera.SetViewAngle(20.0f);
+	camera.SetupCamera();
+
+	Scene scene(camera);
+	Texture* pTexture = new Texture();
+	pTexture->data = texels;
+	pTexture->width = 4;
+	pTexture->height = 4;
+	pTexture->numChannels = 3;
+	scene.textures["quad"] = pTexture;
+
+	Material material;
+	material.name = "quad";
+	material.pDiffuse = pTexture;
+	scene.materials.push_back(material);
+
+	// Far quad first so the near one overdraws it
+	const float depths[] = { -1.0f, 0.0f };
+	for (float z : depths)
+	{
+		std::uint32_t base = static_cast<std::uint32_t>(scene.vertexBuffer.size());
+		scene.vertexBuffer.push_back({ glm::vec3(-2.f + z, -2.f, z), glm::vec3(0, 0, 1), glm::vec2(0.1f, 0.1f) });
+		scene.vertexBuffer.push_back({ glm::vec3(2.f + z, -2.f, z), glm::vec3(0, 0, 1), glm::vec2(0.9f, 0.1f) });
+		scene.vertexBuffer.push_back({ glm::vec3(2.f + z, 2.f, z), glm::vec3(0, 0, 1), glm::vec2(0.9f, 0.9f) });
+		scene.vertexBuffer.push_back({ glm::vec3(-2.f + z, 2.f, z), glm::vec3(0, 0, 1), glm::vec2(0.1f, 0.9f) });
+
+		Mesh mesh;
+		mesh.idxOffset = static_cast<std::uint32_t>(scene.indexBuffer.size());
+		mesh.idxCount = 6;
+		mesh.materialIdx = 0;
+		for (std::uint32_t idx : { 0u, 1u, 2u, 0u, 2u, 3u })
+			scene.indexBuffer.push_back(base + idx);
+		scene.primitives.push_back(mesh);
+	}
+	return scene;
+}
+
+// Renders the quad scene with the given settings and returns the depth buffer
+static std::vector<float> RenderQuadScene(RenderMode mode, bool simd)
+{
+	Rasterizer rasterizer(MakeQuadScene(), 256, 192);
+	rasterizer.SetRenderMode(mode);
+	rasterizer.SetSimd(simd);
+	rasterizer.TransformScene();
+	return rasterizer.GetDepthBuffer();
+}
 
 TEST(SceneTests, TextureStruct)
 {
@@ -11,6 +78,29 @@ TEST(SceneTests, TextureStruct)
 	EXPECT_EQ(texture.numChannels, -1);
 }
 
+TEST(SceneTests, TextureMipChain)
+{
+	// 4x2 grey texture, expanded to opaque RGBA8. Each level averages 2x2 texels of the previous one, all stored as 4x4 tiles
+	stbi_uc texels[] = { 0, 4, 8, 12, 4, 8, 12, 16 };
+	Texture texture;
+	texture.data = texels;
+	texture.width = 4;
+	texture.height = 2;
+	texture.numChannels = 1;
+	texture.GenerateMipChain();
+
+	ASSERT_EQ(texture.mips.size(), 3u);
+	const std::uint32_t* pTexels = texture.GetTexels();
+	EXPECT_EQ(pTexels[texture.mips[0].TexelIndex(3, 1)], 0xFF101010u);
+	EXPECT_EQ(texture.mips[1].width, 2);
+	EXPECT_EQ(texture.mips[1].height, 1);
+	EXPECT_EQ(pTexels[texture.mips[1].TexelIndex(0, 0)], 0xFF040404u);
+	EXPECT_EQ(pTexels[texture.mips[1].TexelIndex(1, 0)], 0xFF0C0C0Cu);
+	EXPECT_EQ(texture.mips[2].width, 1);
+	EXPECT_EQ(texture.mips[2].height, 1);
+	EXPECT_EQ(pTexels[texture.mips[2].TexelIndex(0, 0)], 0xFF080808u);
+}
+
 //TEST(SceneTests, VertexInputStruct)
 //{
 //	VertexInput vInput;
@@ -30,7 +120,116 @@ TEST(SceneTests, MeshStruct)
 	Mesh mesh;
 	EXPECT_EQ(mesh.idxOffset, 0u);
 	EXPECT_EQ(mesh.idxCount, 0u);
-	EXPECT_EQ(mesh.diffuseTexName, "");
+	EXPECT_EQ(mesh.materialIdx, 0u);
+}
+
+TEST(SceneTests, MaterialStruct)
+{
+	Material material;
+	EXPECT_EQ(material.name, "");
+	EXPECT_EQ(material.pDiffuse, nullptr);
+	EXPECT_EQ(material.pNormal, nullptr);
+	EXPECT_EQ(material.pSpecular, nullptr);
+}
+
+TEST(SceneTests, SceneCache)
+{
+	// Textures of a cached scene are sampled from the mapping, and render exactly like the ones decoded from the source images
+	const std::string cacheName = "quad.scene";
+	{
+		Scene scene = MakeQuadScene();
+		scene.textures["quad"]->GenerateMipChain();
+		scene.WriteCache(cacheName);
+	}
+
+	Scene cached(MakeQuadScene().GetCamera());
+	ASSERT_TRUE(cached.LoadCache(cacheName));
+	ASSERT_EQ(cached.vertexBuffer.size(), 8u);
+	ASSERT_EQ(cached.indexBuffer.size(), 12u);
+	ASSERT_EQ(cached.primitives.size(), 2u);
+	ASSERT_EQ(cached.materials.size(), 1u);
+	EXPECT_EQ(cached.materials[0].pDiffuse, cached.textures["quad"]);
+	EXPECT_TRUE(cached.textures["quad"]->tiles.empty());
+	EXPECT_EQ(cached.indexBuffer[6], 4u);
+
+	Rasterizer reference(MakeQuadScene(), 256, 192);
+	reference.TransformScene();
+	Rasterizer rasterizer(std::move(cached), 256, 192);
+	rasterizer.TransformScene();
+	EXPECT_EQ(rasterizer.GetFrameBuffer(), reference.GetFrameBuffer());
+
+	EXPECT_FALSE(Scene().LoadCache("missing.scene"));
+
+	// Records past the header pointing out of their sections are rejected, the scene being left as it was
+	{
+		std::fstream stream(cacheName, std::ios::binary | std::ios::in | std::ios::out);
+		stream.seekg(0, std::ios::end);
+		const std::streamoff size = stream.tellg();
+		const std::streamoff firstSection = 128;
+		ASSERT_GT(size, firstSection);
+		const std::string garbage(static_cast<size_t>(size - firstSection), '\xFF');
+		stream.seekp(firstSection);
+		stream.write(garbage.data(), garbage.size());
+	}
+	Scene corrupt;
+	EXPECT_FALSE(corrupt.LoadCache(cacheName));
+	EXPECT_TRUE(corrupt.vertexBuffer.empty());
+	EXPECT_TRUE(corrupt.primitives.empty());
+	EXPECT_TRUE(corrupt.textures.empty());
+}
+
+TEST(SceneTests, SceneCacheSource)
+{
+	// A cache is only valid for the state of the source file it was written from
+	const std::string cacheName = "quad_source.scene";
+	const std::string sourceName = "quad_source.obj";
+	std::ofstream(sourceName) << "o quad\n";
+	{
+		Scene scene = MakeQuadScene();
+		scene.textures["quad"]->GenerateMipChain();
+		scene.WriteCache(cacheName, sourceName);
+	}
+	EXPECT_TRUE(Scene().LoadCache(cacheName, sourceName));
+	EXPECT_FALSE(Scene().LoadCache(cacheName));
+	EXPECT_FALSE(Scene().LoadCache(cacheName, "missing.obj"));
+
+	std::ofstream(sourceName, std::ios::app) << "v 0 0 0\n";
+	Scene edited;
+	EXPECT_FALSE(edited.LoadCache(cacheName, sourceName));
+	EXPECT_TRUE(edited.vertexBuffer.empty());
+}
+
+TEST(SceneTests, TextureDecoding)
+{
+	// Textures are decoded in the background, those registered after LoadObject by WaitForTextures itself. All of them
+	// have their mip chain once waited for, the source images being released
+	Scene scene;
+	scene.LoadObject("../assets/cube.obj");
+	scene.LoadTexture("container.jpg");
+	scene.LoadTexture("kamen.png");
+	scene.WaitForTextures();
+	ASSERT_EQ(scene.textures.size(), 3u);
+	for (const auto& [name, pTexture] : scene.textures)
+	{
+		SCOPED_TRACE(name);
+		ASSERT_FALSE(pTexture->mips.empty());
+		EXPECT_EQ(pTexture->mips.front().width, pTexture->width);
+		EXPECT_EQ(pTexture->mips.front().height, pTexture->height);
+		EXPECT_EQ(pTexture->mips.back().width, 1);
+		EXPECT_EQ(pTexture->mips.back().height, 1);
+		EXPECT_NE(pTexture->GetTexels(), nullptr);
+		EXPECT_EQ(pTexture->data, nullptr);
+	}
+
+	// Scenes released or replaced while their textures decode stop the workers before freeing them
+	for (int i = 0; i < 4; i++)
+	{
+		Scene replaced;
+		replaced.LoadObject("../assets/cube.obj");
+		replaced = Scene();
+		Scene dropped;
+		dropped.LoadObject("../assets/cube.obj");
+	}
 }
 
 TEST(SceneTests, IndexedPrimitiveStruct)
@@ -40,6 +239,76 @@ TEST(SceneTests, IndexedPrimitiveStruct)
 	EXPECT_EQ(primitive.normalIdx, 0u);
 	EXPECT_EQ(primitive.uvIdx, 0u);
 }
+
+TEST(SceneTests, VertexDeduplication)
+{
+	// Two shapes of triangles sharing positions, normals and texture coordinates (1-based indices, as in the file).
+	// Corners repeated within a shape become a single vertex, a corner differing by its normal does not
+	const std::vector<std::vector<IndexedPrimitive>> shapes =
+	{
+		{ { 1, 1, 1 }, { 2, 1, 2 }, { 3, 1, 1 }, { 3, 1, 1 }, { 2, 1, 2 }, { 4, 1, 2 }, { 1, 1, 1 }, { 3, 1, 1 }, { 5, 1, 2 } },
+		{ { 1, 2, 1 }, { 2, 1, 2 }, { 3, 1, 1 }, { 3, 1, 1 }, { 2, 1, 2 }, { 6, 1, 2 }, { 1, 1, 1 }, { 3, 1, 1 }, { 6, 1, 2 } },
+	};
+	const std::string fileName = "dedup.obj";
+	{
+		std::ofstream obj(fileName);
+		obj << "mtllib cube.mtl\n";
+		for (int i = 0; i < 6; i++)
+			obj << "v " << i % 3 << " " << i / 3 << " 0\n";
+		obj << "vt 0 0\nvt 1 1\n";
+		obj << "vn 0 0 1\nvn 1 0 0\n";
+		for (std::size_t shape = 0; shape < shapes.size(); shape++)
+		{
+			obj << "o shape" << shape << "\nusemtl Material\n";
+			for (std::size_t corner = 0; corner < shapes[shape].size(); corner++)
+			{
+				const IndexedPrimitive& triplet = shapes[shape][corner];
+				obj << (corner % 3 == 0 ? "f" : "") << " " << triplet.posIdx << "/" << triplet.uvIdx << "/" << triplet.normalIdx
+					<< (corner % 3 == 2 ? "\n" : "");
+			}
+		}
+	}
+
+	// Serial reference: one map per shape, vertices numbered in order of first use and shapes appended one after the other
+	std::vector<IndexedPrimitive> expectedVertices;
+	std::vector<std::uint32_t> expectedIndices;
+	std::vector<std::uint32_t> expectedOffsets;
+	for (const std::vector<IndexedPrimitive>& shape : shapes)
+	{
+		expectedOffsets.push_back(static_cast<std::uint32_t>(expectedIndices.size()));
+		const std::uint32_t vertexBase = static_cast<std::uint32_t>(expectedVertices.size());
+		std::map<IndexedPrimitive, std::uint32_t> indices;
+		for (const IndexedPrimitive& triplet : shape)
+		{
+			auto [it, isNew] = indices.emplace(triplet, static_cast<std::uint32_t>(expectedVertices.size()) - vertexBase);
+			if (isNew)
+				expectedVertices.push_back(triplet);
+			expectedIndices.push_back(vertexBase + it->second);
+		}
+	}
+
+	Scene scene;
+	scene.LoadObject(fileName);
+	ASSERT_EQ(scene.vertexBuffer.size(), expectedVertices.size());
+	EXPECT_EQ(scene.vertexBuffer.size(), 10u);
+	ASSERT_EQ(scene.indexBuffer, expectedIndices);
+	ASSERT_EQ(scene.primitives.size(), shapes.size());
+	for (std::size_t shape = 0; shape < shapes.size(); shape++)
+	{
+		EXPECT_EQ(scene.primitives[shape].idxOffset, expectedOffsets[shape]);
+		EXPECT_EQ(scene.primitives[shape].idxCount, shapes[shape].size());
+	}
+
+	// Every vertex holds the attributes of its triplet
+	for (std::size_t i = 0; i < expectedVertices.size(); i++)
+	{
+		const IndexedPrimitive& triplet = expectedVertices[i];
+		const int pos = static_cast<int>(triplet.posIdx) - 1;
+		EXPECT_EQ(scene.vertexBuffer[i].pos, glm::vec3(static_cast<float>(pos % 3), static_cast<float>(pos / 3), 0.0f));
+		EXPECT_EQ(scene.vertexBuffer[i].normal, triplet.normalIdx == 1 ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0));
+		EXPECT_EQ(scene.vertexBuffer[i].texCoords, triplet.uvIdx == 1 ? glm::vec2(0, 1) : glm::vec2(1, 0));
+	}
+}
 //
 //TEST(SceneTests, IndexedPrimitiveStructOperator)
 //{
@@ -63,3 +332,636 @@ TEST(RasterizerTests, RasterizerInit)
 	EXPECT_EQ(rasterizer.GetFrameBuffer().at(0).y, 0);
 	EXPECT_EQ(rasterizer.GetFrameBuffer().at(0).z, 0);
 }
+
+TEST(RasterizerTests, RenderPathsMatch)
+{
+	std::vector<float> reference = RenderQuadScene(RenderMode::Immediate, false);
+	std::size_t covered = std::count_if(reference.begin(), reference.end(), [](float z) { return z != FLT_MAX; });
+	EXPECT_GT(covered, 0u);
+
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		for (bool simd : { false, true })
+		{
+			std::vector<float> depth = RenderQuadScene(mode, simd);
+			ASSERT_EQ(depth.size(), reference.size());
+			std::size_t mismatches = 0;
+			for (std::size_t i = 0; i < depth.size(); i++)
+				mismatches += (depth[i] != FLT_MAX) != (reference[i] != FLT_MAX) || std::abs(depth[i] - reference[i]) > 1e-4f * std::abs(reference[i]);
+			EXPECT_EQ(mismatches, 0u);
+		}
+	}
+}
+
+TEST(RasterizerTests, FrameLoop)
+{
+	const Camera camera = MakeQuadScene().GetCamera();
+	Camera other = camera;
+	other.SetEyePosition(glm::vec3(3, -1, 6));
+	other.SetupCamera();
+
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		Rasterizer reference(MakeQuadScene(), 256, 192);
+		reference.SetRenderMode(mode);
+		reference.TransformScene();
+
+		// A frame from another point of view in between must not leave anything behind
+		Rasterizer rasterizer(MakeQuadScene(), 256, 192);
+		rasterizer.SetRenderMode(mode);
+		for (const Camera& frameCamera : { camera, other, camera })
+		{
+			rasterizer.BeginFrame(frameCamera);
+			rasterizer.Render();
+			rasterizer.EndFrame();
+		}
+
+		EXPECT_EQ(rasterizer.GetDepthBuffer(), reference.GetDepthBuffer());
+		EXPECT_EQ(rasterizer.GetFrameBufferData(), reference.GetFrameBufferData());
+		EXPECT_EQ(rasterizer.GetStats().coveredPixels, reference.GetStats().coveredPixels);
+	}
+}
+
+// Irregular grid of coplanar triangles spanning [-halfExtent, halfExtent] in x and y, using the quad scene camera.
+// Interior vertices are jittered so that edges cross pixel centers at arbitrary angles
+static Scene MakeGridScene(float halfExtent, std::uint32_t cells)
+{
+	Scene scene = MakeQuadScene();
+	scene.vertexBuffer.clear();
+	scene.indexBuffer.clear();
+	scene.primitives.clear();
+
+	const float cellSize = 2.0f * halfExtent / cells;
+	for (std::uint32_t j = 0; j <= cells; j++)
+	{
+		for (std::uint32_t i = 0; i <= cells; i++)
+		{
+			const bool isBorder = i == 0 || j == 0 || i == cells || j == cells;
+			const float jitterX = isBorder ? 0.0f : 0.11f * cellSize * std::sin(static_cast<float>(i * 7 + j * 3));
+			const float jitterY = isBorder ? 0.0f : 0.11f * cellSize * std::cos(static_cast<float>(i * 5 + j * 11));
+			const float x = -halfExtent + cellSize * i + jitterX;
+			const float y = -halfExtent + cellSize * j + jitterY;
+			scene.vertexBuffer.push_back({ glm::vec3(x, y, 0.0f), glm::vec3(0, 0, 1), glm::vec2(0.5f, 0.5f) });
+		}
+	}
+
+	Mesh mesh;
+	mesh.materialIdx = 0;
+	for (std::uint32_t j = 0; j < cells; j++)
+	{
+		for (std::uint32_t i = 0; i < cells; i++)
+		{
+			const std::uint32_t v = j * (cells + 1) + i;
+			for (std::uint32_t idx : { v, v + 1, v + cells + 2, v, v + cells + 2, v + cells + 1 })
+				scene.indexBuffer.push_back(idx);
+		}
+	}
+	mesh.idxCount = static_cast<std::uint32_t>(scene.indexBuffer.size());
+	scene.primitives.push_back(mesh);
+	return scene;
+}
+
+TEST(BvhTests, Cull)
+{
+	// Camera looking at the right half of the grid
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(100.f);
+	camera.SetEyePosition(glm::vec3(4, 0, 12));
+	camera.SetLookDirection(glm::vec3(4, 0, 0));
+	camera.SetViewAngle(0.0f);
+	camera.SetupCamera();
+	const Frustum frustum = camera.GetFrustum();
+
+	// Clusters kept are exactly the ones intersecting the frustum, whether their subtree was accepted whole or not
+	Scene scene = MakeGridScene(8.0f, 96u);
+	scene.BuildBvh();
+	ASSERT_GT(scene.clusters.size(), 64u);
+	std::vector<std::uint8_t> visible;
+	scene.bvh.Cull(frustum, scene.clusters, visible);
+	ASSERT_EQ(visible.size(), scene.clusters.size());
+	std::size_t visibleCount = 0;
+	for (std::size_t i = 0; i < scene.clusters.size(); i++)
+	{
+		EXPECT_EQ(visible[i] != 0, frustum.IntersectsBox(scene.clusters[i].boundsMin, scene.clusters[i].boundsMax));
+		visibleCount += visible[i];
+	}
+	EXPECT_GT(visibleCount, 0u);
+	EXPECT_LT(visibleCount, scene.clusters.size());
+
+	// Deep hierarchy over many small clusters along a line: the traversal must stay within its 64 entry stack, which
+	// holds at most one entry per level plus one
+	std::vector<Cluster> clusters(1u << 14);
+	std::mt19937 random(5204);
+	std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+	for (std::size_t i = 0; i < clusters.size(); i++)
+	{
+		const glm::vec3 center(0.04f * static_cast<float>(i) - 300.0f, jitter(random), jitter(random));
+		clusters[i].boundsMin = center - glm::vec3(0.02f);
+		clusters[i].boundsMax = center + glm::vec3(0.02f);
+	}
+	Bvh bvh;
+	bvh.Build(clusters);
+
+	const std::vector<BvhNode>& nodes = bvh.GetNodes();
+	std::vector<std::uint32_t> depths(nodes.size(), 0u);
+	std::uint32_t maxDepth = 0;
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		maxDepth = std::max(maxDepth, depths[i]);
+		if (nodes[i].leftChild != 0)
+			depths[nodes[i].leftChild] = depths[nodes[i].leftChild + 1] = depths[i] + 1;
+	}
+	EXPECT_GE(maxDepth, 12u);
+	EXPECT_LE(maxDepth + 1, 64u);
+
+	bvh.Cull(frustum, clusters, visible);
+	visibleCount = 0;
+	for (std::size_t i = 0; i < clusters.size(); i++)
+	{
+		EXPECT_EQ(visible[i] != 0, frustum.IntersectsBox(clusters[i].boundsMin, clusters[i].boundsMax));
+		visibleCount += visible[i];
+	}
+	EXPECT_GT(visibleCount, 0u);
+	EXPECT_LT(visibleCount, clusters.size());
+}
+
+TEST(RasterizerTests, FillRule)
+{
+	// Grids larger than the screen: every pixel must be covered exactly once. The dense one is made of triangles of
+	// a few pixels, which go through the small triangle setup
+	Rasterizer coarse(MakeGridScene(20.0f, 12u), 256, 192);
+	Rasterizer dense(MakeGridScene(8.0f, 384u), 256, 192);
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		for (bool simd : { false, true })
+		{
+			for (Rasterizer* pRasterizer : { &coarse, &dense })
+			{
+				pRasterizer->SetRenderMode(mode);
+				pRasterizer->SetSimd(simd);
+				pRasterizer->TransformScene();
+
+				// No crack between the triangles, and no pixel shaded twice along the shared edges
+				const RenderStats stats = pRasterizer->GetStats();
+				EXPECT_EQ(stats.coveredPixels, 256u * 192u);
+				EXPECT_EQ(stats.depthPassedFragments, stats.coveredPixels);
+			}
+
+			// Both grids lie in the same plane, so the depth interpolated over small triangles must match up to rounding
+			const std::vector<float>& reference = coarse.GetDepthBuffer();
+			const std::vector<float>& depth = dense.GetDepthBuffer();
+			std::size_t mismatches = 0;
+			for (std::size_t i = 0; i < depth.size(); i++)
+				mismatches += std::abs(depth[i] - reference[i]) > 1e-3f * std::abs(reference[i]);
+			EXPECT_EQ(mismatches, 0u);
+		}
+	}
+}
+
+TEST(RasterizerTests, SetupPathsMatch)
+{
+	Rasterizer rasterizer(MakeQuadScene(), 256, 192);
+	if (!rasterizer.IsSimdEnabled())
+		GTEST_SKIP() << "No SIMD setup on this CPU";
+
+	// Front-facing triangles in raster space, from sub-pixel ones to ones larger than the screen, some of them cut by
+	// its border. Batches are partially filled to leave lanes unused
+	std::mt19937 random(5204);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const float sizes[] = { 0.6f, 2.0f, 3.5f, 6.0f, 40.0f, 400.0f };
+	std::size_t smallCount = 0;
+	for (std::uint32_t b = 0; b < 256; b++)
+	{
+		TriangleBatch batch;
+		batch.count = 1 + b % TriangleBatch::SIZE;
+		for (std::uint32_t t = 0; t < batch.count; t++)
+		{
+			const float size = sizes[(b + t) % std::size(sizes)];
+			const glm::vec2 center(unit(random) * 296.0f - 20.0f, unit(random) * 232.0f - 20.0f);
+			glm::vec2 corners[3];
+			for (glm::vec2& corner : corners)
+				corner = center + size * glm::vec2(unit(random) - 0.5f, unit(random) - 0.5f);
+			if ((corners[1].x - corners[0].x) * (corners[2].y - corners[0].y) - (corners[2].x - corners[0].x) * (corners[1].y - corners[0].y) > 0.0f)
+				std::swap(corners[1], corners[2]);
+
+			// Depth varies with the size of the triangle, as over a slanted surface
+			const float baseW = 1.0f + 4.0f * unit(random);
+			for (std::uint32_t i = 0; i < 3; i++)
+			{
+				const float w = baseW * (1.0f + 0.001f * size * unit(random));
+				batch.vertices[t][i] = { glm::vec4(corners[i].x * w, corners[i].y * w, unit(random) * w, w),
+					glm::vec3(unit(random), unit(random), unit(random)), glm::vec2(unit(random), unit(random)) };
+			}
+			batch.ids[t] = b * TriangleBatch::SIZE + t;
+		}
+
+		TriangleSetup scalar[TriangleBatch::SIZE];
+		TriangleSetup simd[TriangleBatch::SIZE];
+		rasterizer.SetSimd(false);
+		const std::uint32_t count = rasterizer.SetupTriangles(batch, scalar);
+		rasterizer.SetSimd(true);
+		ASSERT_EQ(rasterizer.SetupTriangles(batch, simd), count);
+
+		for (std::uint32_t k = 0; k < count; k++)
+		{
+			// Coverage must be exactly the same
+			const TriangleSetup& expected = scalar[k];
+			const TriangleSetup& actual = simd[k];
+			ASSERT_EQ(actual.id, expected.id);
+			EXPECT_EQ(actual.minX, expected.minX);
+			EXPECT_EQ(actual.maxX, expected.maxX);
+			EXPECT_EQ(actual.minY, expected.minY);
+			EXPECT_EQ(actual.maxY, expected.maxY);
+			for (auto edge : { &TriangleSetup::E0, &TriangleSetup::E1, &TriangleSetup::E2 })
+			{
+				EXPECT_EQ((actual.*edge).stepX, (expected.*edge).stepX);
+				EXPECT_EQ((actual.*edge).stepY, (expected.*edge).stepY);
+				EXPECT_EQ((actual.*edge).origin, (expected.*edge).origin);
+			}
+			const bool isSmall = expected.maxX - expected.minX <= Rasterizer::SMALL_TRIANGLE_SIZE &&
+				expected.maxY - expected.minY <= Rasterizer::SMALL_TRIANGLE_SIZE;
+			smallCount += isSmall;
+			SCOPED_TRACE(testing::Message() << "batch " << b << " triangle " << k);
+
+			// Gradients only up to rounding, relative to the attributes (all about 1) and to the terms they are summed
+			// from: steps relative to their size, values at the corners of the bounding box relative to the record
+			// that starts at pixel (0, 0). The inverse behind large triangles is looser: slivers a pixel thick are
+			// badly conditioned whichever way the compiler orders the float math
+			const float tolerance = isSmall ? 1e-5f : 1e-4f;
+			for (std::uint32_t attribute = 0; attribute < ATTRIBUTE_COUNT; attribute++)
+			{
+				const float steps = std::abs(expected.gradients.dx[attribute]) + std::abs(expected.gradients.dy[attribute]);
+				EXPECT_NEAR(actual.gradients.dx[attribute], expected.gradients.dx[attribute], tolerance * (1.0f + steps));
+				EXPECT_NEAR(actual.gradients.dy[attribute], expected.gradients.dy[attribute], tolerance * (1.0f + steps));
+				for (std::int32_t y : { expected.minY, expected.maxY - 1 })
+				{
+					for (std::int32_t x : { expected.minX, expected.maxX - 1 })
+					{
+						const float magnitude = std::abs(expected.gradients.start[attribute]) +
+							std::abs(expected.gradients.dx[attribute] * x) + std::abs(expected.gradients.dy[attribute] * y);
+						EXPECT_NEAR(actual.gradients.Evaluate(attribute, x, y), expected.gradients.Evaluate(attribute, x, y), tolerance * (1.0f + magnitude));
+					}
+				}
+			}
+		}
+	}
+	EXPECT_GT(smallCount, 0u);
+
+	// Rounding differences of the whole pipeline may only flip the odd texel or depth tie
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		Rasterizer reference(MakeQuadScene(), 256, 192);
+		reference.SetRenderMode(mode);
+		reference.SetSimd(false);
+		reference.TransformScene();
+		rasterizer.SetRenderMode(mode);
+		rasterizer.SetSimd(true);
+		rasterizer.TransformScene();
+
+		EXPECT_EQ(rasterizer.GetStats().coveredPixels, reference.GetStats().coveredPixels);
+		const std::vector<glm::vec3> expected = reference.GetFrameBuffer();
+		const std::vector<glm::vec3> actual = rasterizer.GetFrameBuffer();
+		std::size_t mismatches = 0;
+		for (std::size_t i = 0; i < expected.size(); i++)
+		{
+			const glm::vec3 difference = glm::abs(actual[i] - expected[i]);
+			mismatches += std::max({ difference.x, difference.y, difference.z }) > 1.5f / 255;
+		}
+		EXPECT_LE(mismatches, reference.GetStats().coveredPixels / 1000);
+	}
+}
+
+TEST(RasterizerTests, VisibilityShading)
+{
+	// Quads are submitted back to front in MakeQuadScene, so forward shading shades the overlap twice
+	Rasterizer forward(MakeQuadScene(), 256, 192);
+	forward.TransformScene();
+
+	Rasterizer deferred(MakeQuadScene(), 256, 192);
+	deferred.SetShadingMode(ShadingMode::Visibility);
+	deferred.TransformScene();
+
+	std::vector<glm::vec3> forwardColors = forward.GetFrameBuffer();
+	std::vector<glm::vec3> deferredColors = deferred.GetFrameBuffer();
+	ASSERT_EQ(forwardColors.size(), deferredColors.size());
+	for (std::size_t i = 0; i < forwardColors.size(); i++)
+		EXPECT_EQ(forwardColors[i], deferredColors[i]);
+
+	// Every covered pixel is shaded exactly once
+	RenderStats stats = deferred.GetStats();
+	EXPECT_GT(stats.coveredPixels, 0u);
+	EXPECT_EQ(stats.shadedFragments, stats.coveredPixels);
+	EXPECT_GT(stats.depthPassedFragments, stats.shadedFragments);
+	EXPECT_EQ(forward.GetStats().shadedFragments, forward.GetStats().depthPassedFragments);
+
+	// Switching modes between frames leaves nothing of the previous mode behind
+	deferred.SetShadingMode(ShadingMode::Forward);
+	deferred.TransformScene();
+	EXPECT_EQ(deferred.GetFrameBuffer(), forwardColors);
+	EXPECT_EQ(deferred.GetStats().shadedFragments, forward.GetStats().shadedFragments);
+	deferred.SetShadingMode(ShadingMode::Visibility);
+	deferred.TransformScene();
+	EXPECT_EQ(deferred.GetFrameBuffer(), deferredColors);
+	EXPECT_EQ(deferred.GetStats().shadedFragments, stats.shadedFragments);
+}
+
+TEST(RasterizerTests, FrameBufferFormats)
+{
+	EXPECT_EQ(FloatToHalf(1.0f), 0x3C00u);
+	EXPECT_EQ(FloatToHalf(65504.0f), 0x7BFFu);
+	EXPECT_EQ(FloatToHalf(1e6f), 0x7C00u);
+	EXPECT_EQ(HalfToFloat(FloatToHalf(0.3f)), 0.30004883f);
+	EXPECT_EQ(HalfToFloat(FloatToHalf(1e-6f)), std::ldexp(17.0f, -24));
+
+	// Every format stores the same image up to its precision
+	Rasterizer reference(MakeQuadScene(), 256, 192);
+	reference.TransformScene();
+	const std::vector<glm::vec3> referenceColors = reference.GetFrameBuffer();
+	for (FrameBufferFormat format : { FrameBufferFormat::RGB10A2, FrameBufferFormat::RGBA16F })
+	{
+		Rasterizer rasterizer(MakeQuadScene(), 256, 192);
+		rasterizer.SetFrameBufferFormat(format);
+		rasterizer.TransformScene();
+		EXPECT_EQ(rasterizer.GetFrameBufferData().size(), 256u * 192u * GetPixelWords(format));
+
+		const std::vector<glm::vec3> colors = rasterizer.GetFrameBuffer();
+		std::size_t mismatches = 0;
+		for (std::size_t i = 0; i < colors.size(); i++)
+			for (int c = 0; c < 3; c++)
+				mismatches += std::abs(colors[i][c] - referenceColors[i][c]) > 1.01f / 255;
+		EXPECT_EQ(mismatches, 0u);
+	}
+}
+
+TEST(RasterizerTests, PngEncoding)
+{
+	// Tall enough for several bands, each deflated on its own, to be stitched into the stream libpng decodes
+	const std::uint32_t width = 300u;
+	const std::uint32_t height = 500u;
+	auto pixel = [](std::uint32_t x, std::uint32_t y, std::uint32_t c) { return static_cast<std::uint8_t>((x * (c + 1) + y * 7 + (x * y) % 13) & 0xFF); };
+	const std::vector<std::uint8_t> png = PngEncoder::Encode(width, height, [&pixel](std::uint32_t y, std::uint8_t* pRow)
+		{
+			for (std::uint32_t x = 0; x < width; x++)
+				for (std::uint32_t c = 0; c < 3; c++)
+					pRow[x * 3 + c] = pixel(x, y, c);
+		});
+
+	png_image image{};
+	image.version = PNG_IMAGE_VERSION;
+	ASSERT_NE(png_image_begin_read_from_memory(&image, png.data(), png.size()), 0);
+	EXPECT_EQ(image.width, width);
+	EXPECT_EQ(image.height, height);
+	image.format = PNG_FORMAT_RGB;
+	std::vector<std::uint8_t> decoded(PNG_IMAGE_SIZE(image));
+	ASSERT_NE(png_image_finish_read(&image, nullptr, decoded.data(), 0, nullptr), 0);
+
+	std::size_t mismatches = 0;
+	for (std::uint32_t y = 0; y < height; y++)
+		for (std::uint32_t x = 0; x < width; x++)
+			for (std::uint32_t c = 0; c < 3; c++)
+				mismatches += decoded[(y * width + x) * 3 + c] != pixel(x, y, c);
+	EXPECT_EQ(mismatches, 0u);
+}
+
+TEST(RasterizerTests, ImageWriters)
+{
+	Rasterizer rasterizer(MakeQuadScene(), 256, 192);
+	rasterizer.TransformScene();
+	const std::vector<std::uint32_t>& pixels = rasterizer.GetFrameBufferData();
+
+	auto readFile = [](const std::string& fileName)
+		{
+			std::ifstream file(fileName, std::ios::binary);
+			return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		};
+
+	// Raw dumps are the frame buffer as is
+	ASSERT_TRUE(rasterizer.RenderToFile("quad.rgba", *CreateImageWriter(ImageFormat::Raw)));
+	const std::vector<std::uint8_t> raw = readFile("quad.rgba");
+	ASSERT_EQ(raw.size(), pixels.size() * sizeof(std::uint32_t));
+	EXPECT_EQ(memcmp(raw.data(), pixels.data(), raw.size()), 0);
+
+	// PPM and PNG hold the same RGB samples
+	ASSERT_TRUE(rasterizer.RenderToFile("quad.ppm", *CreateImageWriter(ImageFormat::Ppm)));
+	const std::vector<std::uint8_t> ppm = readFile("quad.ppm");
+	const std::string ppmHeader = "P6\n256 192\n255\n";
+	ASSERT_EQ(ppm.size(), ppmHeader.size() + pixels.size() * 3);
+	EXPECT_EQ(std::string(ppm.begin(), ppm.begin() + ppmHeader.size()), ppmHeader);
+
+	rasterizer.RenderToPng("quad.png");
+	png_image image{};
+	image.version = PNG_IMAGE_VERSION;
+	ASSERT_NE(png_image_begin_read_from_file(&image, "quad.png"), 0);
+	image.format = PNG_FORMAT_RGB;
+	std::vector<std::uint8_t> decoded(PNG_IMAGE_SIZE(image));
+	ASSERT_NE(png_image_finish_read(&image, nullptr, decoded.data(), 0, nullptr), 0);
+	EXPECT_TRUE(std::equal(decoded.begin(), decoded.end(), ppm.begin() + ppmHeader.size()));
+
+	// PFM rows go bottom to top
+	ASSERT_TRUE(rasterizer.RenderToFile("quad.pfm", *CreateImageWriter(ImageFormat::Pfm)));
+	const std::vector<std::uint8_t> pfm = readFile("quad.pfm");
+	const std::string pfmHeader = "PF\n256 192\n-1.0\n";
+	ASSERT_EQ(pfm.size(), pfmHeader.size() + pixels.size() * 3 * sizeof(float));
+	const std::vector<glm::vec3> colors = rasterizer.GetFrameBuffer();
+	glm::vec3 firstRow;
+	memcpy(&firstRow, pfm.data() + pfmHeader.size(), sizeof(firstRow));
+	EXPECT_EQ(firstRow, colors[191 * 256]);
+
+	// QOI compresses the large flat areas
+	ASSERT_TRUE(rasterizer.RenderToFile("quad.qoi", *CreateImageWriter(ImageFormat::Qoi)));
+	const std::vector<std::uint8_t> qoi = readFile("quad.qoi");
+	ASSERT_GT(qoi.size(), 22u);
+	EXPECT_EQ(std::string(qoi.begin(), qoi.begin() + 4), "qoif");
+	EXPECT_LT(qoi.size(), pixels.size());
+	EXPECT_EQ(qoi.back(), 1u);
+}
+
+TEST(RasterizerTests, Clipping)
+{
+	// Camera on the z axis: the plane x = 0 projects onto the boundary between the two halves of the screen
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(1000.f);
+	camera.SetEyePosition(glm::vec3(0, 0, 5));
+	camera.SetLookDirection(glm::vec3(0, 0, 0));
+	camera.SetViewAngle(0.0f);
+	camera.SetupCamera();
+
+	// Triangles bounded by x = 0, one crossing the near plane (a floor reaching behind the camera), one spanning
+	// thousands of screens, so far past the guard band. Both must only cover the left half of the screen
+	const glm::vec3 nearPlaneCrossing[3] = { glm::vec3(0, -0.5f, 100.f), glm::vec3(0, -0.5f, -100.f), glm::vec3(-100.f, -0.5f, -100.f) };
+	const glm::vec3 guardBandCrossing[3] = { glm::vec3(0, -5000.f, 0), glm::vec3(0, 5000.f, 0), glm::vec3(-5000.f, 0, 0) };
+	for (const glm::vec3* pVertices : { nearPlaneCrossing, guardBandCrossing })
+	{
+		Scene scene = MakeQuadScene();
+		scene.SetCamera(camera);
+		scene.vertexBuffer.clear();
+		scene.indexBuffer.clear();
+		scene.primitives.resize(1);
+		for (std::uint32_t i = 0; i < 3; i++)
+		{
+			scene.vertexBuffer.push_back({ pVertices[i], glm::vec3(0, 0, 1), glm::vec2(0.5f, 0.5f) });
+			scene.indexBuffer.push_back(i);
+		}
+		scene.primitives[0].idxOffset = 0;
+		scene.primitives[0].idxCount = 3;
+		Rasterizer rasterizer(std::move(scene), 256, 192);
+
+		std::vector<float> reference;
+		for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+		{
+			rasterizer.SetRenderMode(mode);
+			rasterizer.TransformScene();
+			const std::vector<float>& depth = rasterizer.GetDepthBuffer();
+
+			std::uint64_t leftPixels = 0;
+			std::uint64_t rightPixels = 0;
+			for (std::uint32_t y = 0; y < 192; y++)
+			{
+				for (std::uint32_t x = 0; x < 256; x++)
+				{
+					const bool written = depth[y * 256 + x] != FLT_MAX;
+					(x < 128 ? leftPixels : rightPixels) += written;
+				}
+			}
+			EXPECT_GT(leftPixels, 0u);
+			EXPECT_EQ(rightPixels, 0u);
+			EXPECT_EQ(rasterizer.GetStats().coveredPixels, leftPixels);
+			if (pVertices == guardBandCrossing)
+			{
+				EXPECT_EQ(leftPixels, 128u * 192u);
+			}
+
+			// Same clipped triangles in both modes
+			if (reference.empty())
+				reference = depth;
+			else
+				EXPECT_EQ(depth, reference);
+		}
+	}
+}
+
+TEST(RasterizerTests, HiZOcclusion)
+{
+	Camera camera;
+	camera.SetNearPlane(0.1f);
+	camera.SetFarPlane(100.f);
+	camera.SetEyePosition(glm::vec3(0, 0, 5));
+	camera.SetLookDirection(glm::vec3(0, 0, 0));
+	camera.SetViewAngle(0.0f);
+	camera.SetupCamera();
+
+	// Near occluder covering the whole screen, and a far quad entirely behind it. The occluder is a single triangle:
+	// the Hi-Z only records blocks fully covered by one triangle, those along the diagonal of a quad would stay open
+	auto makeScene = [&camera](bool farFirst)
+		{
+			Scene scene = MakeQuadScene();
+			scene.SetCamera(camera);
+			scene.vertexBuffer.clear();
+			scene.indexBuffer.clear();
+			scene.primitives.clear();
+
+			const std::vector<glm::vec3> nearOccluder = { glm::vec3(-10.f, -10.f, 0.f), glm::vec3(10.f, -10.f, 0.f), glm::vec3(0.f, 10.f, 0.f) };
+			const std::vector<glm::vec3> farQuad = { glm::vec3(-1.f, -1.f, -5.f), glm::vec3(1.f, -1.f, -5.f), glm::vec3(1.f, 1.f, -5.f), glm::vec3(-1.f, 1.f, -5.f) };
+			for (const std::vector<glm::vec3>* pPolygon : { farFirst ? &farQuad : &nearOccluder, farFirst ? &nearOccluder : &farQuad })
+			{
+				// Fan of the polygon, one mesh each
+				Mesh mesh;
+				mesh.idxOffset = static_cast<std::uint32_t>(scene.indexBuffer.size());
+				mesh.materialIdx = 0;
+				const std::uint32_t base = static_cast<std::uint32_t>(scene.vertexBuffer.size());
+				for (const glm::vec3& corner : *pPolygon)
+					scene.vertexBuffer.push_back({ corner, glm::vec3(0, 0, 1), glm::vec2(0.5f + 0.04f * corner.x, 0.5f + 0.04f * corner.y) });
+				for (std::uint32_t k = 1; k + 1 < pPolygon->size(); k++)
+					for (std::uint32_t idx : { 0u, k, k + 1 })
+						scene.indexBuffer.push_back(base + idx);
+				mesh.idxCount = static_cast<std::uint32_t>(scene.indexBuffer.size()) - mesh.idxOffset;
+				scene.primitives.push_back(mesh);
+			}
+			return scene;
+		};
+
+	Rasterizer frontToBack(makeScene(false), 256, 192);
+	Rasterizer backToFront(makeScene(true), 256, 192);
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		for (bool simd : { false, true })
+		{
+			for (Rasterizer* pRasterizer : { &frontToBack, &backToFront })
+			{
+				pRasterizer->SetRenderMode(mode);
+				pRasterizer->SetSimd(simd);
+				pRasterizer->TransformScene();
+			}
+
+			// Drawn after the occluder, the far quad is rejected by the Hi-Z before any of its fragments is tested
+			const RenderStats stats = frontToBack.GetStats();
+			EXPECT_EQ(stats.coveredPixels, 256u * 192u);
+			EXPECT_EQ(stats.depthPassedFragments, stats.coveredPixels);
+			EXPECT_GE(stats.occludedTriangles, 2u);
+
+			// Drawn first, it is overdrawn instead, to the same image
+			const RenderStats overdrawStats = backToFront.GetStats();
+			EXPECT_EQ(overdrawStats.occludedTriangles, 0u);
+			EXPECT_GT(overdrawStats.depthPassedFragments, overdrawStats.coveredPixels);
+			EXPECT_EQ(frontToBack.GetFrameBuffer(), backToFront.GetFrameBuffer());
+			EXPECT_EQ(frontToBack.GetDepthBuffer(), backToFront.GetDepthBuffer());
+		}
+	}
+}
+
+TEST(RasterizerTests, FrustumCulling)
+{
+	std::vector<float> reference = RenderQuadScene(RenderMode::Immediate, true);
+
+	for (RenderMode mode : { RenderMode::Immediate, RenderMode::Tiled })
+	{
+		// Extra quad behind the camera, its cluster must be culled without changing the image
+		Scene scene = MakeQuadScene();
+		std::uint32_t base = static_cast<std::uint32_t>(scene.vertexBuffer.size());
+		scene.vertexBuffer.push_back({ glm::vec3(-2.f, -2.f, 20.f), glm::vec3(0, 0, 1), glm::vec2(0.1f, 0.1f) });
+		scene.vertexBuffer.push_back({ glm::vec3(2.f, -2.f, 20.f), glm::vec3(0, 0, 1), glm::vec2(0.9f, 0.1f) });
+		scene.vertexBuffer.push_back({ glm::vec3(2.f, 2.f, 20.f), glm::vec3(0, 0, 1), glm::vec2(0.9f, 0.9f) });
+
+		Mesh hidden;
+		hidden.idxOffset = static_cast<std::uint32_t>(scene.indexBuffer.size());
+		hidden.idxCount = 3;
+		hidden.materialIdx = 0;
+		for (std::uint32_t idx : { 0u, 1u, 2u })
+			scene.indexBuffer.push_back(base + idx);
+		scene.primitives.push_back(hidden);
+
+		Rasterizer rasterizer(std::move(scene), 256, 192);
+		rasterizer.SetRenderMode(mode);
+		rasterizer.TransformScene();
+		EXPECT_EQ(rasterizer.GetStats().culledTriangles, 1u);
+		EXPECT_EQ(rasterizer.GetDepthBuffer(), reference);
+	}
+}
+
+TEST(SchedulerTests, ParallelFor)
+{
+	for (std::uint32_t threadCount : { 1u, 4u })
+	{
+		TaskScheduler scheduler(threadCount);
+		EXPECT_EQ(scheduler.GetThreadCount(), threadCount);
+
+		// Every iteration runs exactly once, including those of loops nested inside the tasks
+		std::vector<std::atomic<std::uint32_t>> visits(100000);
+		scheduler.ParallelFor(0u, 1000u, 7u, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			for (std::uint32_t i = begin; i < end; i++)
+				scheduler.ParallelFor(i * 100u, (i + 1) * 100u, 16u, [&](std::uint32_t first, std::uint32_t last)
+				{
+					for (std::uint32_t j = first; j < last; j++)
+						visits[j].fetch_add(1u, std::memory_order_relaxed);
+				});
+		});
+		EXPECT_TRUE(std::all_of(visits.begin(), visits.end(), [](const std::atomic<std::uint32_t>& count) { return count.load() == 1u; }));
+
+		bool isCalled = false;
+		scheduler.ParallelFor(5u, 5u, 1u, [&](std::uint32_t, std::uint32_t) { isCalled = true; });
+		EXPECT_FALSE(isCalled);
+	}
+}